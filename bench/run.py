@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# Builds the synthetic Lys programs in this directory with the given
+# backends and frontends, runs them without a display, and compares
+# the mean frame times with a stored baseline.  Used by 'make bench'
+# (see the top-level Makefile).
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+# Program name, frame size, and extra command line options.
+PROGRAMS = [
+    ('fill', (640, 480), []),
+    ('particles', (640, 480), []),
+    ('events', (320, 240), ['-E', '256']),
+    ('text', (320, 240), []),
+    # The same work, updating the state in place or by copying it.
+    ('grid', (640, 480), ['-E', '8']),
+    ('grid_copy', (640, 480), ['-E', '8']),
+]
+
+bench_dir = os.path.dirname(os.path.abspath(__file__))
+# The 'lib' directory containing github.com/diku-dk/lys.
+lib_dir = os.path.abspath(os.path.join(bench_dir, '..', 'lib'))
+
+parser = argparse.ArgumentParser(description='Run the Lys benchmarks.')
+parser.add_argument('--backends', default='c multicore')
+parser.add_argument('--frontends', default='console')
+parser.add_argument('--frames', type=int, default=200)
+parser.add_argument('--build-dir', default='_lys_bench')
+parser.add_argument('--output', default='lys_bench.json')
+parser.add_argument('--baseline', default='lys_bench_baseline.json')
+parser.add_argument('--tolerance', type=float, default=0.15,
+                    help='Allowed relative increase of the mean frame time.')
+parser.add_argument('--update-baseline', action='store_true')
+parser.add_argument('--frontend-cpus', help='Pin the frontend thread (-a).')
+parser.add_argument('--worker-cpus', help='Pin the Futhark threads (-A).')
+args = parser.parse_args()
+
+def build(frontend, backend, name):
+    build_dir = os.path.join(args.build_dir, '{}-{}'.format(frontend, backend))
+    os.makedirs(build_dir, exist_ok=True)
+    # The programs import lys as ../lib/..., which the links resolve.
+    for link, target in [('lib', lib_dir), ('bench', bench_dir)]:
+        link = os.path.join(build_dir, link)
+        if not os.path.exists(link):
+            os.symlink(target, link)
+    with open(os.path.join(build_dir, 'Makefile'), 'w') as f:
+        f.write('include lib/github.com/diku-dk/lys/common.mk\n')
+    with open(os.path.join(build_dir, name + '.fut'), 'w') as f:
+        f.write('open import "bench/{}"\n'.format(name))
+    subprocess.run(['make', '-s', '-C', build_dir, 'PROGNAME=' + name,
+                    'LYS_BACKEND=' + backend, 'LYS_FRONTEND=' + frontend],
+                   check=True)
+    return build_dir
+
+def run(frontend, build_dir, name, size, options):
+    result_file = os.path.join(build_dir, name + '.json')
+    cmd = ['./' + name, '-f', str(args.frames), '-w', str(size[0]), '-h', str(size[1]),
+           '-B', os.path.basename(result_file)] + options
+    if args.frontend_cpus:
+        cmd += ['-a', args.frontend_cpus]
+    if args.worker_cpus:
+        cmd += ['-A', args.worker_cpus]
+    env = dict(os.environ)
+    if frontend == 'console':
+        cmd += ['-n', '/dev/null']
+    else:
+        # No frame rate limit, and no need for a display.
+        cmd += ['-r', '100000', '-R']
+        env['SDL_VIDEODRIVER'] = 'dummy'
+    subprocess.run(cmd, cwd=build_dir, env=env, check=True,
+                   stdout=subprocess.DEVNULL)
+    with open(result_file) as f:
+        return json.load(f)
+
+results = {}
+for frontend in args.frontends.split():
+    for backend in args.backends.split():
+        for name, size, options in PROGRAMS:
+            key = '{}/{}/{}'.format(name, frontend, backend)
+            print('Running {}...'.format(key), file=sys.stderr)
+            build_dir = build(frontend, backend, name)
+            results[key] = run(frontend, build_dir, name, size, options)
+
+with open(args.output, 'w') as f:
+    json.dump(results, f, indent=2, sort_keys=True)
+
+if args.update_baseline or not os.path.exists(args.baseline):
+    with open(args.baseline, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    print('Wrote baseline {}.'.format(args.baseline))
+    sys.exit(0)
+
+with open(args.baseline) as f:
+    baseline = json.load(f)
+
+regressions = 0
+print('{:32} {:>10} {:>10} {:>8} {:>10} {:>10} {:>10} {:>10}'
+      .format('benchmark', 'baseline', 'now', 'change', 'stddev', 'migrations',
+              'p99 input', 'memory'))
+for key, result in sorted(results.items()):
+    now = result['frame_ms']['mean']
+    # Jitter, how often the frontend thread moved between CPUs, the
+    # input-to-display latency of the synthetic events (-E), and the
+    # peak memory use of the context and frame buffers.
+    memory = result['memory']
+    spread = '{:>8.3f}ms {:>10} {:>8.3f}ms {:>7.1f}MiB'.format(
+        result['frame_ms']['stddev'], result['placement']['migrations'],
+        result['latency_ms']['p99'],
+        (memory['context_peak'] + memory['host_peak']) / (1024 * 1024))
+    if key not in baseline:
+        print('{:32} {:>10} {:>8.3f}ms {:>8} {}'.format(key, '-', now, 'new', spread))
+        continue
+    before = baseline[key]['frame_ms']['mean']
+    change = now / before - 1
+    flag = ''
+    if change > args.tolerance:
+        flag = '  REGRESSION'
+        regressions += 1
+    print('{:32} {:>8.3f}ms {:>8.3f}ms {:>+7.1f}% {}{}'
+          .format(key, before, now, change * 100, spread, flag))
+
+if regressions > 0:
+    print('{} benchmark(s) slower than the baseline by more than {:.0f}%.'
+          .format(regressions, args.tolerance * 100))
+    sys.exit(1)
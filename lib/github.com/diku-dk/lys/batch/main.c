@@ -0,0 +1,290 @@
+// Runs many instances of a program in lockstep, each from its own
+// seed, for offline studies.  The instances are stepped and rendered
+// together by the entry points in genbatch.fut, so that small programs
+// still fill the device.
+
+#include "shared.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+void usage(char **argv) {
+  printf("Usage: %s options...\n", argv[0]);
+  puts("Options:");
+  puts("  -?       Print this help and exit.");
+  puts("  -w INT   Frame width.");
+  puts("  -h INT   Frame height.");
+  puts("  -r INT   Frames per second of simulated time.");
+  puts("  -f INT   Frames rendered.");
+  puts("  -k INT   Number of instances.");
+  puts("  -s INT   Seed of the first instance; the others count up from it.");
+  puts("  -S FILE  Read the seeds from FILE, one instance per seed.");
+  puts("  -o DIR   Write the frames of instance i to DIR/i.ppm.");
+  puts("  -H FILE  Record hashes of the frames to FILE.");
+  puts("  -V FILE  Check the frames against the hashes in FILE.");
+  puts("  -d DEV   Set the computation device.");
+  puts("  -i       Select execution device interactively.");
+}
+
+static uint32_t* read_seeds(const char *path, int *num_seeds) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  int capacity = 64;
+  uint32_t *seeds = malloc(capacity * sizeof(uint32_t));
+  assert(seeds != NULL);
+  *num_seeds = 0;
+  unsigned long seed;
+  while (fscanf(f, "%lu", &seed) == 1) {
+    if (*num_seeds == capacity) {
+      capacity *= 2;
+      seeds = realloc(seeds, capacity * sizeof(uint32_t));
+      assert(seeds != NULL);
+    }
+    seeds[(*num_seeds)++] = seed;
+  }
+  fclose(f);
+  if (*num_seeds == 0) {
+    fprintf(stderr, "%s contains no seeds.\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return seeds;
+}
+
+// Append a frame to 'f' as a binary PPM image, so that each output file
+// is a stream of images.
+static void write_frame(FILE *f, const uint32_t *pixels, int height, int width,
+                        unsigned char *row) {
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint32_t p = pixels[y*width+x];
+      row[x*3+0] = (p >> 16) & 0xFF;
+      row[x*3+1] = (p >> 8) & 0xFF;
+      row[x*3+2] = p & 0xFF;
+    }
+    fwrite(row, 3, width, f);
+  }
+}
+
+int main(int argc, char** argv) {
+  int width = 320, height = 240, max_fps = 60;
+  int num_frames = 60, num_instances = 16;
+  uint32_t first_seed = 0;
+  char *seeds_path = NULL;
+  char *output_dir = NULL;
+  char *golden_path = NULL;
+  bool golden_verify = false;
+  char *deviceopt = NULL;
+  bool device_interactive = false;
+  long long seed_arg;
+  char *seed_end;
+
+  int c;
+  while ( (c = getopt(argc, argv, "w:h:r:f:k:s:S:o:H:V:d:i")) != -1) {
+    switch (c) {
+    case 'w':
+      width = atoi(optarg);
+      if (width <= 0) {
+        fprintf(stderr, "'%s' is not a valid width.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      height = atoi(optarg);
+      if (height <= 0) {
+        fprintf(stderr, "'%s' is not a valid height.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      max_fps = atoi(optarg);
+      if (max_fps <= 0) {
+        fprintf(stderr, "'%s' is not a valid framerate.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      num_frames = atoi(optarg);
+      if (num_frames <= 0) {
+        fprintf(stderr, "'%s' is not a number of frames.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'k':
+      num_instances = atoi(optarg);
+      if (num_instances <= 0) {
+        fprintf(stderr, "'%s' is not a number of instances.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      seed_arg = strtoll(optarg, &seed_end, 10);
+      if (*optarg == '\0' || *seed_end != '\0' ||
+          seed_arg < INT32_MIN || seed_arg > UINT32_MAX) {
+        fprintf(stderr, "'%s' is not a valid seed.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      first_seed = (uint32_t)seed_arg;
+      break;
+    case 'S':
+      seeds_path = optarg;
+      break;
+    case 'o':
+      output_dir = optarg;
+      break;
+    case 'H':
+      golden_path = optarg;
+      golden_verify = false;
+      break;
+    case 'V':
+      golden_path = optarg;
+      golden_verify = true;
+      break;
+    case 'd':
+      deviceopt = optarg;
+      break;
+    case 'i':
+      device_interactive = true;
+      break;
+    case '?':
+      usage(argv);
+      return EXIT_SUCCESS;
+    default:
+      fprintf(stderr, "unknown option: %c\n", c);
+      usage(argv);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    fprintf(stderr, "Excess non-options: ");
+    while (optind < argc)
+      fprintf(stderr, "%s ", argv[optind++]);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t *seeds;
+  if (seeds_path != NULL) {
+    seeds = read_seeds(seeds_path, &num_instances);
+  } else {
+    seeds = malloc(num_instances * sizeof(uint32_t));
+    assert(seeds != NULL);
+    for (int i = 0; i < num_instances; i++) {
+      seeds[i] = first_seed + i;
+    }
+  }
+
+  FILE **outputs = NULL;
+  uint32_t *frames = NULL;
+  unsigned char *row = NULL;
+  size_t frame_size = (size_t)height * width;
+  if (output_dir != NULL) {
+    if (mkdir(output_dir, 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Cannot create %s: %s\n", output_dir, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    outputs = calloc(num_instances, sizeof(FILE*));
+    assert(outputs != NULL);
+    for (int i = 0; i < num_instances; i++) {
+      int bufsize = strlen(output_dir) + 32;
+      char buf[bufsize];
+      snprintf(buf, bufsize, "%s/%d.ppm", output_dir, i);
+      outputs[i] = fopen(buf, "w");
+      if (outputs[i] == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", buf, strerror(errno));
+        return EXIT_FAILURE;
+      }
+    }
+    row = malloc(width * 3);
+    assert(row != NULL);
+  }
+
+  struct lys_golden golden = { .failed = false };
+  if (golden_path != NULL && !lys_golden_open(&golden, golden_path, golden_verify)) {
+    return EXIT_FAILURE;
+  }
+
+  if (output_dir != NULL || golden_path != NULL) {
+    frames = malloc((size_t)num_instances * frame_size * sizeof(uint32_t));
+    assert(frames != NULL);
+  }
+
+  struct futhark_context_config *futcfg;
+  struct futhark_context *fut;
+  char* opencl_device_name = NULL;
+  lys_setup_futhark_context(argv[0],
+                            deviceopt, device_interactive, false,
+                            &futcfg, &fut, &opencl_device_name);
+  if (opencl_device_name != NULL) {
+    printf("Using OpenCL device: %s\n", opencl_device_name);
+    free(opencl_device_name);
+  }
+
+  struct futhark_u32_1d *seeds_arr = futhark_new_u32_1d(fut, seeds, num_instances);
+  assert(seeds_arr != NULL);
+  struct futhark_opaque_batch *batch;
+  FUT_CHECK(fut, futhark_entry_init_batch(fut, &batch, seeds_arr, height, width));
+  FUT_CHECK(fut, futhark_free_u32_1d(fut, seeds_arr));
+
+  int64_t start = lys_wall_time();
+  for (int frame = 0; frame < num_frames && !golden.failed; frame++) {
+    struct futhark_opaque_batch *new_batch;
+    FUT_CHECK(fut, futhark_entry_step_batch(fut, &new_batch, 1.0/max_fps, batch));
+    FUT_CHECK(fut, futhark_free_opaque_batch(fut, batch));
+    batch = new_batch;
+
+    struct futhark_u32_3d *out_arr;
+    FUT_CHECK(fut, futhark_entry_render_batch(fut, &out_arr, height, width, batch));
+    if (frames != NULL) {
+      FUT_CHECK(fut, futhark_values_u32_3d(fut, out_arr, frames));
+      FUT_CHECK(fut, futhark_context_sync(fut));
+    }
+    for (int i = 0; outputs != NULL && i < num_instances; i++) {
+      write_frame(outputs[i], &frames[(size_t)i*frame_size], height, width, row);
+    }
+    for (int i = 0; golden_path != NULL && i < num_instances; i++) {
+      char label[32];
+      snprintf(label, sizeof(label), "%d/%d", frame, i);
+      if (!lys_golden_frame(&golden, label, &frames[(size_t)i*frame_size], height, width)) {
+        break;
+      }
+    }
+    FUT_CHECK(fut, futhark_free_u32_3d(fut, out_arr));
+  }
+  FUT_CHECK(fut, futhark_context_sync(fut));
+  int64_t end = lys_wall_time();
+
+  double seconds = ((double)end-start)/1000000;
+  printf("Rendered %d frames of %d instances in %fs (%f frames per second)\n",
+         num_frames, num_instances, seconds, (int64_t)num_frames * num_instances / seconds);
+
+  if (golden_path != NULL) {
+    if (golden_verify && !golden.failed) {
+      printf("All %ld frames match %s.\n", (long)golden.frames, golden_path);
+    }
+    lys_golden_close(&golden);
+  }
+
+  FUT_CHECK(fut, futhark_free_opaque_batch(fut, batch));
+  futhark_context_free(fut);
+  futhark_context_config_free(futcfg);
+
+  if (outputs != NULL) {
+    for (int i = 0; i < num_instances; i++) {
+      fclose(outputs[i]);
+    }
+    free(outputs);
+    free(row);
+  }
+  free(frames);
+  free(seeds);
+
+  return golden.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,41 +10,131 @@ SELF_DIR := $(dir $(lastword $(MAKEFILE_LIST)))
 include $(SELF_DIR)/setup_flags.mk
 FRONTEND_DIR = $(SELF_DIR)/$(LYS_FRONTEND)
 
+# With LYS_HOT_RELOAD=1 the Futhark program is built as a shared library
+# that the running program reloads whenever it is rebuilt.  Both record
+# the types of text_content, so that a library that changes them is
+# refused.
+ifeq ($(LYS_HOT_RELOAD),1)
+PROG_OBJ=$(PROGNAME)_signature.c
+all: $(PROGNAME)_wrapper.so
+CFLAGS+= -DLYS_HOT_RELOAD -DLYS_HOT_RELOAD_LIBRARY='"./$(PROGNAME)_wrapper.so"'
+LDFLAGS+= -ldl
+else
+PROG_OBJ=$(PROGNAME)_wrapper.o
+endif
+
+# With LYS_IDLE=1 the program must define 'needs_redraw' (see the
+# lys_idle module type), and frames are only computed when it or an
+# event says that something may have changed.
+ifeq ($(LYS_IDLE),1)
+GEN_FUT=$(SELF_DIR)/genlys.fut $(SELF_DIR)/genidle.fut
+CFLAGS+= -DLYS_IDLE
+else
+GEN_FUT=$(SELF_DIR)/genlys.fut
+endif
+
+# With LYS_INTEREST=1 the program must define 'interest' (see the
+# lys_interest module type), and events of other kinds are dropped
+# before they reach Futhark.
+ifeq ($(LYS_INTEREST),1)
+GEN_FUT+= $(SELF_DIR)/geninterest.fut
+CFLAGS+= -DLYS_INTEREST
+endif
+
 ifeq ($(LYS_FRONTEND), sdl)
 FONT_DEPS=font_data.h
 else
 FONT_DEPS=
 endif
 
+# With LYS_DEVICE_TEXT=1 the text overlay is composited into the frames
+# by the Futhark program (see gentext.fut), using a glyph atlas baked
+# from the font at LYS_FONT_ATLAS_SIZE pixels.  Baking needs FreeType.
+LYS_FONT_ATLAS_SIZE?=16
+ifeq ($(LYS_DEVICE_TEXT),1)
+GEN_FUT+= $(SELF_DIR)/gentext.fut
+CFLAGS+= -DLYS_DEVICE_TEXT
+FONT_DEPS+= font_atlas.h
+endif
+
+ifeq ($(LYS_FRONTEND), net)
+all: lys-net-viewer
+else
+all: lys-shm-reader
+endif
+
 ifeq ($(shell test futhark.pkg -nt lib; echo $$?),0)
 $(PROGNAME):
 	futhark pkg sync
 	@make # The sync might have resulted in a new Makefile.
 else
-$(PROGNAME): $(PROGNAME)_wrapper.o $(PROGNAME)_printf.h $(FONT_DEPS) $(FRONTEND_DIR)/liblys.c $(FRONTEND_DIR)/liblys.h $(SELF_DIR)/shared.c $(SELF_DIR)/shared.h $(FRONTEND_DIR)/main.c
-	gcc $(FRONTEND_DIR)/liblys.c $(SELF_DIR)/shared.c $(FRONTEND_DIR)/main.c -I. -I$(SELF_DIR) -DPROGHEADER='"$(PROGNAME)_wrapper.h"' -DPRINTFHEADER='"$(PROGNAME)_printf.h"' -DLYS_TEXT $(PROGNAME)_wrapper.o -o $@ $(CFLAGS) $(LDFLAGS)
+$(PROGNAME): $(PROG_OBJ) $(PROGNAME)_printf.h $(FONT_DEPS) $(FRONTEND_DIR)/liblys.c $(FRONTEND_DIR)/liblys.h $(SELF_DIR)/shared.c $(SELF_DIR)/shared.h $(SELF_DIR)/shm.c $(SELF_DIR)/shm.h $(SELF_DIR)/metrics.c $(SELF_DIR)/metrics.h $(FRONTEND_DIR)/main.c
+	gcc $(FRONTEND_DIR)/liblys.c $(SELF_DIR)/shared.c $(SELF_DIR)/shm.c $(SELF_DIR)/metrics.c $(FRONTEND_DIR)/main.c -I. -I$(SELF_DIR) -DPROGHEADER='"$(PROGNAME)_wrapper.h"' -DPRINTFHEADER='"$(PROGNAME)_printf.h"' -DLYS_TEXT $(PROG_OBJ) -o $@ $(CFLAGS) $(LDFLAGS)
 endif
 
+# Runs many instances of the program at once; see batch/main.c.  Not
+# built by default, as it requires a state that is not size-lifted.
+$(PROGNAME)-batch: $(PROGNAME)_batch_wrapper.o $(SELF_DIR)/batch/main.c $(SELF_DIR)/shared.c $(SELF_DIR)/shared.h
+	gcc $(SELF_DIR)/batch/main.c $(SELF_DIR)/shared.c -I. -I$(SELF_DIR) -DPROGHEADER='"$(PROGNAME)_batch_wrapper.h"' $(PROGNAME)_batch_wrapper.o -o $@ $(filter-out -DLYS_HOT_RELOAD% -DLYS_DEVICE_TEXT,$(CFLAGS)) $(LDFLAGS)
+
+# Renders one very large image in tiles; see poster/main.c.  Not built
+# by default, as the program must define 'render_tile' (see the
+# lys_tiled module type).
+$(PROGNAME)-poster: $(PROGNAME)_poster_wrapper.o $(SELF_DIR)/poster/main.c $(SELF_DIR)/shared.c $(SELF_DIR)/shared.h
+	gcc $(SELF_DIR)/poster/main.c $(SELF_DIR)/shared.c -I. -I$(SELF_DIR) -DPROGHEADER='"$(PROGNAME)_poster_wrapper.h"' $(PROGNAME)_poster_wrapper.o -o $@ $(filter-out -DLYS_HOT_RELOAD% -DLYS_DEVICE_TEXT,$(CFLAGS)) $(LDFLAGS)
+
+lys-net-viewer: $(SELF_DIR)/net/viewer.c $(SELF_DIR)/net/protocol.h
+	gcc $< -o $@ $(NOWARN_CFLAGS) -Wall -Wextra -pedantic
+
+lys-shm-reader: $(SELF_DIR)/shm_reader.c $(SELF_DIR)/shm.c $(SELF_DIR)/shm.h
+	gcc $(SELF_DIR)/shm_reader.c $(SELF_DIR)/shm.c -o $@ $(NOWARN_CFLAGS) -Wall -Wextra -pedantic $(SHM_LDFLAGS)
+
 $(PROGNAME)_printf.h: $(PROGNAME)_wrapper.c
 	python3 $(SELF_DIR)/gen_printf.py $(FRONTEND_DIR) $@ $<
 
+$(PROGNAME)_signature.c: $(PROGNAME)_wrapper.c
+	python3 $(SELF_DIR)/gen_printf.py --signature $@ $<
+
 font_data.h: $(SELF_DIR)/Inconsolata-Regular.ttf
 	echo 'unsigned char font_data[] = {' > $@
 	xxd -i - < $< >> $@
 	echo '};' >> $@
 
+font_atlas.h: $(SELF_DIR)/font_atlas.c $(SELF_DIR)/Inconsolata-Regular.ttf
+	gcc $< -o lys-font-atlas $(NOWARN_CFLAGS) $(shell pkg-config --cflags --libs freetype2)
+	./lys-font-atlas $(SELF_DIR)/Inconsolata-Regular.ttf $(LYS_FONT_ATLAS_SIZE) > $@.tmp
+	rm lys-font-atlas
+	mv $@.tmp $@
+
 # We do not want warnings and such for the generated code.
 $(PROGNAME)_wrapper.o: $(PROGNAME)_wrapper.c
 	gcc -o $@ -c $< $(NOWARN_CFLAGS)
 
+$(PROGNAME)_batch_wrapper.o: $(PROGNAME)_batch_wrapper.c
+	gcc -o $@ -c $< $(NOWARN_CFLAGS)
+
+$(PROGNAME)_poster_wrapper.o: $(PROGNAME)_poster_wrapper.c
+	gcc -o $@ -c $< $(NOWARN_CFLAGS)
+
+# Renamed into place, so a running program never sees half of it.
+$(PROGNAME)_wrapper.so: $(PROGNAME)_wrapper.c $(PROGNAME)_signature.c
+	gcc -o $@.tmp -shared -fPIC $^ $(NOWARN_CFLAGS) $(DEVICE_LDFLAGS)
+	mv $@.tmp $@
+
 %.c: %.fut
 	futhark $(LYS_BACKEND) --library $<
 
-%_wrapper.fut: $(SELF_DIR)/genlys.fut $(PROG_FUT_DEPS)
-	cat $< | sed 's/"lys"/"$(PROGNAME)"/' > $@
+%_wrapper.fut: $(GEN_FUT) $(PROG_FUT_DEPS)
+	cat $(GEN_FUT) | sed 's/"lys"/"$(PROGNAME)"/' > $@
+
+%_batch_wrapper.fut: $(GEN_FUT) $(SELF_DIR)/genbatch.fut $(PROG_FUT_DEPS)
+	cat $(GEN_FUT) $(SELF_DIR)/genbatch.fut | sed 's/"lys"/"$(PROGNAME)"/' > $@
+
+%_poster_wrapper.fut: $(GEN_FUT) $(SELF_DIR)/gentile.fut $(PROG_FUT_DEPS)
+	cat $(GEN_FUT) $(SELF_DIR)/gentile.fut | sed 's/"lys"/"$(PROGNAME)"/' > $@
 
 run: $(PROGNAME)
 	./$(PROGNAME)
 
 clean:
-	rm -f $(PROGNAME) $(PROGNAME).c $(PROGNAME).h $(PROGNAME)_wrapper.* $(PROGNAME)_printf.h *.o font_data.h
+	rm -f $(PROGNAME) $(PROGNAME)-batch $(PROGNAME)-poster $(PROGNAME).c $(PROGNAME).h $(PROGNAME)_wrapper.* $(PROGNAME)_batch_wrapper.* $(PROGNAME)_poster_wrapper.* $(PROGNAME)_printf.h $(PROGNAME)_signature.c *.o font_data.h font_atlas.h lys-net-viewer lys-shm-reader
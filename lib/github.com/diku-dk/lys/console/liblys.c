@@ -2,6 +2,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 struct termios orig_termios;
 
@@ -29,12 +34,110 @@ void def() {
   printf("\033[0m");
 }
 
-void fg_rgb(FILE *f, uint8_t r, uint8_t g, uint8_t b) {
-  fprintf(f, "\033[38;2;%d;%d;%dm", r, g, b);
+// The escape sequences are formatted by hand, as printf() is by far
+// the slowest part of encoding a frame.  Channels are at most 255.
+static inline char* put_decimal(char *p, int v) {
+  if (v >= 100) {
+    *p++ = '0' + v/100;
+  }
+  if (v >= 10) {
+    *p++ = '0' + v/10%10;
+  }
+  *p++ = '0' + v%10;
+  return p;
+}
+
+static char* put_rgb(char *p, char layer, uint32_t w) {
+  memcpy(p, "\033[x8;2;", 7);
+  p[2] = layer;
+  p = put_decimal(p+7, (w>>16)&0xFF);
+  *p++ = ';';
+  p = put_decimal(p, (w>>8)&0xFF);
+  *p++ = ';';
+  p = put_decimal(p, w&0xFF);
+  *p++ = 'm';
+  return p;
+}
+
+static char* put_256(char *p, char layer, int n) {
+  memcpy(p, "\033[x8;5;", 7);
+  p[2] = layer;
+  p = put_decimal(p+7, n);
+  *p++ = 'm';
+  return p;
 }
 
-void bg_rgb(FILE *f, uint8_t r, uint8_t g, uint8_t b) {
-  fprintf(f, "\033[48;2;%d;%d;%dm", r, g, b);
+// The nearest colour in the xterm 256-colour palette of every colour
+// with 5 bits per channel.  The 16 system colours are left out, as
+// users can redefine them.
+static uint8_t quantize_table[32*32*32];
+
+static const int cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+// A 4x4 Bayer matrix, for ordered dithering.
+static const int bayer[4][4] = {
+  { 0,  8,  2, 10},
+  {12,  4, 14,  6},
+  { 3, 11,  1,  9},
+  {15,  7, 13,  5}
+};
+
+// Roughly the distance between the levels of the colour cube.
+#define LYS_DITHER_SPREAD 40
+
+static int nearest_level(int v) {
+  int best = 0;
+  for (int i = 1; i < 6; i++) {
+    if (abs(cube_levels[i] - v) < abs(cube_levels[best] - v)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Weighted by how sensitive the eye is to each channel.
+static int colour_distance(int r0, int g0, int b0, int r1, int g1, int b1) {
+  return 3*(r0-r1)*(r0-r1) + 4*(g0-g1)*(g0-g1) + 2*(b0-b1)*(b0-b1);
+}
+
+static void init_quantize_table() {
+  for (int i = 0; i < 32*32*32; i++) {
+    int r = ((i >> 10) & 31) * 255 / 31;
+    int g = ((i >> 5) & 31) * 255 / 31;
+    int b = (i & 31) * 255 / 31;
+
+    // The distance is separable, so the nearest colour in the cube has
+    // the nearest level in every channel.
+    int cr = nearest_level(r), cg = nearest_level(g), cb = nearest_level(b);
+    int best = 16 + 36*cr + 6*cg + cb;
+    int best_distance = colour_distance(r, g, b,
+                                        cube_levels[cr], cube_levels[cg], cube_levels[cb]);
+
+    // The greys are 8, 18, ..., 238.
+    int grey = (3*r + 4*g + 2*b) / 9;
+    int k = grey < 8 ? 0 : (grey - 3) / 10;
+    k = k > 23 ? 23 : k;
+    int v = 8 + 10*k;
+    if (colour_distance(r, g, b, v, v, v) < best_distance) {
+      best = 232 + k;
+    }
+    quantize_table[i] = best;
+  }
+}
+
+static inline int clamp_channel(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline int quantize(uint32_t w, int offset) {
+  int r = clamp_channel(((w>>16)&0xFF) + offset);
+  int g = clamp_channel(((w>>8)&0xFF) + offset);
+  int b = clamp_channel((w&0xFF) + offset);
+  return quantize_table[(r>>3)<<10 | (g>>3)<<5 | (b>>3)];
+}
+
+static inline int dither_offset(int x, int y) {
+  return (bayer[y&3][x&3]*2 - 15) * LYS_DITHER_SPREAD / 32;
 }
 
 void cursor_goto(int x, int y) {
@@ -58,232 +161,654 @@ void render(int nrows, int ncols, const uint32_t *rgbs,
   }
 }
 
-void display(FILE *f, bool eol, int nrows, int ncols,
-             const uint32_t *fgs, const uint32_t *bgs, const char *chars) {
+// Longest truecolour foreground and background sequences.
+#define LYS_TRUECOLOUR_CHANGE_BYTES 38
+
+// Encodes rows [first, first+nrows) into 'p', which must have room for
+// LYS_TRUECOLOUR_CHANGE_BYTES+3 bytes per cell and one per row.  The
+// colours are always sent for the first cell, so the rows do not
+// depend on what came before them.  Counts the colour changes in
+// '*changes', from which LYS_COLOUR_AUTO picks the mode of the next
+// frame, and returns the end of the output.
+static char* display(char *p, bool eol, int first, int nrows, int ncols,
+                     const uint32_t *fgs, const uint32_t *bgs, const char *chars,
+                     bool use_256, bool dither, size_t *changes) {
   uint32_t prev_w0 = 0xdeadbeef;
   uint32_t prev_w1 = 0xdeadbeef;
-  for (int i = 0; i < nrows; i++) {
+  int prev_c0 = -1;
+  int prev_c1 = -1;
+  for (int i = first; i < first+nrows; i++) {
     for (int j = 0; j < ncols; j++) {
-      double r0 = 0, g0 = 0, b0 = 0;
-      double r1 = 0, g1 = 0, b1 = 0;
       uint32_t w0 = fgs[i*ncols+j];
       uint32_t w1 = bgs[i*ncols+j];
+      char c = chars[i*ncols+j];
       if (w0 != prev_w0 || w1 != prev_w1) {
-        r0 = (w0>>16)&0xFF;
-        g0 = (w0>>8)&0xFF;
-        b0 = (w0>>0)&0xFF;
-        r1 = (w1>>16)&0xFF;
-        g1 = (w1>>8)&0xFF;
-        b1 = (w1>>0)&0xFF;
-        fg_rgb(f, r0, g0, b0);
-        bg_rgb(f, r1, g1, b1);
+        (*changes)++;
+        if (!use_256) {
+          p = put_rgb(p, '3', w0);
+          p = put_rgb(p, '4', w1);
+        }
         prev_w0 = w0;
         prev_w1 = w1;
       }
-      char c = chars[i*ncols+j];
+      if (use_256) {
+        // Each cell is two pixels, and text is not dithered.
+        bool d = dither && c == 127;
+        int c0 = quantize(w0, d ? dither_offset(j, i*2) : 0);
+        int c1 = quantize(w1, d ? dither_offset(j, i*2+1) : 0);
+        if (c0 != prev_c0 || c1 != prev_c1) {
+          p = put_256(p, '3', c0);
+          p = put_256(p, '4', c1);
+          prev_c0 = c0;
+          prev_c1 = c1;
+        }
+      }
       if (c == 127) {
-        fputs("▀", f);
+        memcpy(p, "▀", 3);
+        p += 3;
       } else {
-        fputc(c, f);
+        *p++ = c;
       }
     }
     if (eol) {
-      fputc('\n', f);
+      *p++ = '\n';
     }
   }
+  return p;
 }
 
-void keydown(struct lys_context *ctx, int keysym) {
-  ctx->key_pressed = keysym;
-  struct futhark_opaque_state *new_state;
-  FUT_CHECK(ctx->fut, futhark_entry_key(ctx->fut, &new_state, 0, keysym, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
-  ctx->state = new_state;
+// Frames are rendered and encoded in bands of this many rows, which
+// are spread over the encoding threads.  As each band starts by setting
+// its colours, the output does not depend on the number of threads.
+#define LYS_BAND_ROWS 8
+
+struct lys_band {
+  struct lys_buffer buffer;
+  size_t len;
+  size_t changes;
+};
+
+// The encoding threads.  The calling thread works on bands too, so
+// there is one thread fewer in the pool than there are encoding
+// threads.
+struct lys_pool {
+  pthread_t *threads;
+  int num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Bumped for every run, so the threads can tell a new run from a
+  // spurious wakeup.
+  unsigned long generation;
+  // Threads that have not yet finished the current run.
+  int busy;
+  bool stop;
+  void (*work)(struct lys_context*, int band);
+  struct lys_context *ctx;
+  int num_bands;
+  atomic_int next_band;
+};
+
+static void pool_work(struct lys_pool *pool) {
+  int band;
+  while ((band = atomic_fetch_add(&pool->next_band, 1)) < pool->num_bands) {
+    pool->work(pool->ctx, band);
+  }
 }
 
+static void* pool_thread(void *arg) {
+  struct lys_pool *pool = arg;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stop && pool->generation == seen) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
 
-void keyup(struct lys_context *ctx, int keysym) {
-  struct futhark_opaque_state *new_state;
-  FUT_CHECK(ctx->fut, futhark_entry_key(ctx->fut, &new_state, 1, keysym, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
-  ctx->state = new_state;
+    pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      pthread_cond_broadcast(&pool->cond);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static struct lys_pool* pool_create(int num_threads) {
+  struct lys_pool *pool = calloc(1, sizeof(struct lys_pool));
+  assert(pool != NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->threads = calloc(num_threads, sizeof(pthread_t));
+  assert(num_threads == 0 || pool->threads != NULL);
+  pool->num_threads = num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    assert(pthread_create(&pool->threads[i], NULL, pool_thread, pool) == 0);
+  }
+  return pool;
+}
+
+static void pool_free(struct lys_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool->threads);
+  free(pool);
+}
+
+// Calls 'work' on every band and returns when all are done.
+static void pool_run(struct lys_pool *pool, struct lys_context *ctx,
+                     void (*work)(struct lys_context*, int), int num_bands) {
+  if (pool->num_threads == 0 || num_bands <= 1) {
+    for (int band = 0; band < num_bands; band++) {
+      work(ctx, band);
+    }
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->work = work;
+  pool->ctx = ctx;
+  pool->num_bands = num_bands;
+  atomic_store(&pool->next_band, 0);
+  pool->busy = pool->num_threads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_work(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static int band_rows(struct lys_context *ctx, int band, int *first) {
+  int nrows = ctx->height/2;
+  *first = band * LYS_BAND_ROWS;
+  return nrows - *first < LYS_BAND_ROWS ? nrows - *first : LYS_BAND_ROWS;
+}
+
+static void render_band(struct lys_context *ctx, int band) {
+  int first;
+  int nrows = band_rows(ctx, band, &first);
+  int ncols = ctx->width;
+  render(nrows, ncols, ctx->frame + (size_t)first*2*ncols,
+         ctx->fgs + (size_t)first*ncols, ctx->bgs + (size_t)first*ncols,
+         ctx->chars + (size_t)first*ncols);
+}
+
+static void display_band(struct lys_context *ctx, int band) {
+  int first;
+  int nrows = band_rows(ctx, band, &first);
+  struct lys_band *b = &ctx->bands[band];
+  char *start = b->buffer.data;
+  b->changes = 0;
+  char *end = display(start, !ctx->interactive, first, nrows, ctx->width,
+                      ctx->fgs, ctx->bgs, ctx->chars, ctx->use_256, ctx->dither,
+                      &b->changes);
+  b->len = end - start;
+}
+
+// The band buffers are reserved up front by the calling thread, as
+// lys_buffer_reserve() keeps track of memory use.
+static void reserve_bands(struct lys_context *ctx, int num_bands) {
+  if (num_bands > ctx->num_bands) {
+    ctx->bands = realloc(ctx->bands, num_bands*sizeof(struct lys_band));
+    assert(ctx->bands != NULL);
+    memset(ctx->bands + ctx->num_bands, 0,
+           (num_bands - ctx->num_bands)*sizeof(struct lys_band));
+    ctx->num_bands = num_bands;
+  }
+  size_t size = (size_t)LYS_BAND_ROWS *
+    ((size_t)ctx->width*(LYS_TRUECOLOUR_CHANGE_BYTES+3) + 1);
+  for (int band = 0; band < num_bands; band++) {
+    lys_buffer_reserve(&ctx->bands[band].buffer, size);
+  }
+}
+
+#define LYS_MAX_IOVECS 64
+
+// Writes the bands after whatever is buffered in 'f', in as few system
+// calls as the kernel allows.
+static void write_bands(FILE *f, const struct lys_band *bands, int num_bands) {
+  fflush(f);
+  int fd = fileno(f);
+  int band = 0;
+  size_t offset = 0; // Into the first band not yet written in full.
+  while (band < num_bands) {
+    struct iovec iov[LYS_MAX_IOVECS];
+    int n = 0;
+    for (int b = band; b < num_bands && n < LYS_MAX_IOVECS; b++, n++) {
+      size_t skip = b == band ? offset : 0;
+      iov[n].iov_base = (char*)bands[b].buffer.data + skip;
+      iov[n].iov_len = bands[b].len - skip;
+    }
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    offset += written;
+    while (band < num_bands && offset >= bands[band].len) {
+      offset -= bands[band].len;
+      band++;
+    }
+  }
+}
+
+void lys_submit_key(struct lys_context *ctx, int e, int keysym) {
+  struct lys_input input = { .kind = LYS_INPUT_KEY, .a = e, .b = keysym,
+                             .time = ctx->event_time };
+  lys_frame_job_submit(&ctx->job, &input);
 }
 
 void get_terminal_size(int* nrows, int* ncols) {
   struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0) {
+    w.ws_row = 0;
+    w.ws_col = 0;
+  }
   *nrows = w.ws_row;
   *ncols = w.ws_col;
 }
 
-void resize(struct lys_context *ctx) {
-  int nrows, ncols;
-  get_terminal_size(&nrows, &ncols);
+static volatile sig_atomic_t winch_received = 0;
+
+static void handle_sigwinch(int sig) {
+  (void)sig;
+  winch_received = 1;
+}
+
+// The character buffers need only one entry per terminal cell, but
+// draw_text() bounds its writes by the pixel size, so all buffers are
+// as large as a frame.
+static void alloc_buffers(struct lys_context *ctx) {
+  size_t n = (size_t)ctx->width * ctx->height;
+  ctx->fgs = lys_buffer_reserve(&ctx->fgs_buffer, n*sizeof(uint32_t));
+  ctx->bgs = lys_buffer_reserve(&ctx->bgs_buffer, n*sizeof(uint32_t));
+  ctx->chars = lys_buffer_reserve(&ctx->chars_buffer, n*sizeof(char));
+#ifndef LYS_HOST_FRAMES
+  ctx->rgbs = lys_buffer_reserve(&ctx->rgbs_buffer, n*sizeof(uint32_t));
+#endif
+}
+
+void resize(struct lys_context *ctx, int nrows, int ncols) {
+  assert(!ctx->in_flight);
   ctx->width = ncols;
   ctx->height = nrows*2;
-  ctx->fgs = realloc(ctx->fgs, nrows*ncols*sizeof(uint32_t));
-  ctx->bgs = realloc(ctx->bgs, nrows*ncols*sizeof(uint32_t));
-  ctx->chars = realloc(ctx->chars, nrows*ncols*sizeof(char));
-  ctx->rgbs = realloc(ctx->rgbs, ctx->width*ctx->height*sizeof(uint32_t));
+  alloc_buffers(ctx);
 
   struct futhark_opaque_state *new_state;
+  int64_t start = lys_wall_time();
   FUT_CHECK(ctx->fut, futhark_entry_resize(ctx->fut, &new_state, ctx->height, ctx->width, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
+  lys_metrics_entry(LYS_ENTRY_RESIZE, start);
+  lys_state_created();
+  lys_free_state(ctx->fut, ctx->state);
   ctx->state = new_state;
+  ctx->job.idle = false;
 }
 
+// Only ask the terminal for its size when SIGWINCH has told us that
+// it may have changed, and only resize once the size has settled.
 void maybe_resize(struct lys_context *ctx) {
   int nrows, ncols;
-  get_terminal_size(&nrows, &ncols);
+  if (winch_received) {
+    winch_received = 0;
+    get_terminal_size(&nrows, &ncols);
+    if (nrows > 0 && ncols > 0) {
+      lys_resize_request(&ctx->resize, ncols, nrows);
+    }
+  }
 
-  if (nrows != ctx->width || ncols*2 != ctx->height) {
-    resize(ctx);
+  if (lys_resize_settled(&ctx->resize, &ncols, &nrows) &&
+      (ncols != ctx->width || nrows*2 != ctx->height)) {
+    resize(ctx, nrows, ncols);
   }
 }
 
-// Best-effort at translating VT100 key codes to SDL.
-//
-// The handling of keydown/keyup events is complicated by the fact
-// that the terminal does not report keyup events.  As a workaround,
-// we treat every input key as a keydown for one frame, then a keyup
-// the following frame.  Many applications will misbehave, but not
-// all!
-void check_input(struct lys_context *ctx) {
-  if (ctx->key_pressed) {
-    keyup(ctx, ctx->key_pressed);
-    ctx->key_pressed = 0;
+// Read everything that is currently pending on stdin into the input
+// buffer, without blocking.  The time of the first unconsumed byte is
+// remembered so we can tell how long it took to reach the screen.
+static void drain_input(struct lys_context *ctx) {
+  while (ctx->input_len < LYS_INPUT_BUFFER_SIZE) {
+    ssize_t n = read(STDIN_FILENO, ctx->input + ctx->input_len,
+                     LYS_INPUT_BUFFER_SIZE - ctx->input_len);
+    if (n <= 0) {
+      break;
+    }
+    if (ctx->input_len == 0) {
+      ctx->input_time = lys_wall_time();
+    }
+    ctx->input_len += n;
+  }
+}
+
+// Sleep for up to 'usecs' microseconds, but read input as soon as it
+// arrives.  Returns early if the terminal was resized, or if
+// 'until_input' and there was input.
+static void wait_for_input(struct lys_context *ctx, int64_t usecs, bool until_input) {
+  int64_t deadline = lys_wall_time() + usecs;
+  while (!winch_received) {
+    // With a full buffer stdin stays readable, so only sleep until it
+    // has been parsed.
+    struct pollfd pfd = { .fd = ctx->input_len < LYS_INPUT_BUFFER_SIZE ? STDIN_FILENO : -1,
+                          .events = POLLIN };
+    int64_t left = deadline - lys_wall_time();
+    if (left < 0) {
+      left = 0;
+    }
+    // Rounded up, so we do not spin through the last millisecond.
+    int res = poll(&pfd, 1, (left+999)/1000);
+    if (res > 0) {
+      drain_input(ctx);
+    }
+    if (left == 0 || (res < 0 && errno != EINTR) || (until_input && res > 0)) {
+      break;
+    }
+  }
+}
+
+static void push_key(int *keys, int *num_keys, int keysym) {
+  if (*num_keys < LYS_INPUT_BUFFER_SIZE) {
+    keys[(*num_keys)++] = keysym;
   }
+}
 
-  char c;
-  if (read(STDIN_FILENO, &c, 1) != 0) {
+// Best-effort at translating VT100 key codes to SDL.  Parses the
+// entire input buffer in one pass and returns the number of keys
+// found.  Bytes that form an incomplete escape sequence at the end of
+// the buffer are ignored, like a lone escape always has been.
+static int parse_input(struct lys_context *ctx, const unsigned char *buf, int n,
+                       int *keys) {
+  int num_keys = 0;
+  int i = 0;
+  while (i < n) {
+    unsigned char c = buf[i++];
     switch (c) {
     case 3: // Ctrl-c
       ctx->running = 0;
-      return;
+      return num_keys;
     case 0x1b: // Escape
-      if (read(STDIN_FILENO, &c, 1) != 0) {
-        switch (c) {
-        case 0x1b: // Double escape!
-          ctx->running = 0;
-          return;
-        case 'O': // Application key
-          if (read(STDIN_FILENO, &c, 1) != 0) {
-            switch (c) {
-            case 'P':
-              keydown(ctx, 0x4000003A);
-              return;
-            case 'Q':
-              keydown(ctx, 0x4000003B);
-              return;
-            case 'R':
-              keydown(ctx, 0x4000003C);
-              return;
-            case 'S':
-              keydown(ctx, 0x4000003D);
-              return;
-            }
-          }
-          return;
-        }
+      if (i == n) {
+        break;
       }
-      if (read(STDIN_FILENO, &c, 1) != 0) {
-        switch (c) {
+      c = buf[i++];
+      if (c == 0x1b) { // Double escape!
+        ctx->running = 0;
+        return num_keys;
+      } else if (c == 'O') { // Application key
+        if (i == n) {
+          break;
+        }
+        switch (buf[i++]) {
+        case 'P':
+          push_key(keys, &num_keys, 0x4000003A);
+          break;
+        case 'Q':
+          push_key(keys, &num_keys, 0x4000003B);
+          break;
+        case 'R':
+          push_key(keys, &num_keys, 0x4000003C);
+          break;
+        case 'S':
+          push_key(keys, &num_keys, 0x4000003D);
+          break;
+        }
+      } else {
+        // Control sequence: skip any parameters and look at the final
+        // byte.
+        while (i < n && buf[i] >= 0x30 && buf[i] <= 0x3F) {
+          i++;
+        }
+        if (i == n) {
+          break;
+        }
+        switch (buf[i++]) {
         case 'A':
           // Arrow up
-          keydown(ctx, 0x40000052);
-          return;
+          push_key(keys, &num_keys, 0x40000052);
+          break;
         case 'B':
           // Arrow down
-          keydown(ctx, 0x40000051);
-          return;
+          push_key(keys, &num_keys, 0x40000051);
+          break;
         case 'C':
           // Arrow right
-          keydown(ctx, 0x4000004F);
-          return;
+          push_key(keys, &num_keys, 0x4000004F);
+          break;
         case 'D':
           // Arrow left
-          keydown(ctx, 0x40000050);
-          return;
+          push_key(keys, &num_keys, 0x40000050);
+          break;
         }
       }
       break;
     default:
       if (c >= 'a' && c <= 'z') {
-        keydown(ctx, 0x61 + (c-'a'));
-        return;
-      }
-      if (c >= '0' && c <= '9') {
-        keydown(ctx, 0x30 + (c-'0'));
-        return;
+        push_key(keys, &num_keys, 0x61 + (c-'a'));
+      } else if (c >= '0' && c <= '9') {
+        push_key(keys, &num_keys, 0x30 + (c-'0'));
       }
     }
   }
+  return num_keys;
 }
 
-void lys_run_console(struct lys_context *ctx) {
+// The handling of keydown/keyup events is complicated by the fact
+// that the terminal does not report keyup events.  As a workaround,
+// we treat every input key as a keydown for one frame, then a keyup
+// the following frame.  Many applications will misbehave, but not
+// all!
+void check_input(struct lys_context *ctx) {
+  // These keyups are made up, so their latency means nothing.
+  ctx->event_time = -1;
+  for (int i = 0; i < ctx->num_keys_pressed; i++) {
+    lys_submit_key(ctx, 1, ctx->keys_pressed[i]);
+  }
+  ctx->num_keys_pressed = 0;
+  ctx->event_time = 0;
+
+  drain_input(ctx);
+  if (ctx->input_len == 0) {
+    return;
+  }
+
+  int keys[LYS_INPUT_BUFFER_SIZE];
+  int num_keys = parse_input(ctx, ctx->input, ctx->input_len, keys);
+  ctx->input_len = 0;
+  ctx->event_time = ctx->input_time;
+
+  for (int i = 0; i < num_keys && ctx->running; i++) {
+    if (keys[i] == 0x4000003A) {
+      ctx->event_handler(ctx, LYS_F1);
+      continue;
+    }
+    if (keys[i] == 0x4000003B) {
+      ctx->event_handler(ctx, LYS_F2);
+      continue;
+    }
+    lys_submit_key(ctx, 0, keys[i]);
+    bool seen = false;
+    for (int j = 0; j < ctx->num_keys_pressed; j++) {
+      seen = seen || ctx->keys_pressed[j] == keys[i];
+    }
+    if (!seen) {
+      ctx->keys_pressed[ctx->num_keys_pressed++] = keys[i];
+    }
+  }
+  ctx->event_time = 0;
+}
+
+void lys_open(struct lys_context *ctx) {
+  if (ctx->colour_mode != LYS_COLOUR_TRUE) {
+    init_quantize_table();
+  }
+  ctx->use_256 = ctx->colour_mode == LYS_COLOUR_256;
+
+  int threads = ctx->encode_threads;
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus < 1 ? 1 : cpus > LYS_MAX_ENCODE_THREADS ? LYS_MAX_ENCODE_THREADS : cpus;
+  }
+  ctx->pool = pool_create(threads - 1);
+
   ctx->running = 1;
   ctx->last_time = lys_wall_time();
-
-  int num_frames = 0;
+  lys_frame_job_init(&ctx->job, ctx->fut);
 
   ctx->event_handler(ctx, LYS_LOOP_START);
+}
 
-  while (ctx->running && ctx->num_frames-- > 0) {
-    num_frames++;
-    int64_t now = lys_wall_time();
-    float delta;
-    if (ctx->interactive) {
-      delta = ((float)(now - ctx->last_time))/1000000.0;
-    } else {
-      delta = 1/(double)ctx->max_fps;
+void lys_begin_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  if (ctx->interactive) {
+    maybe_resize(ctx);
+  }
+
+#ifdef LYS_HOT_RELOAD
+  if (lys_hot_reload(&ctx->job, &ctx->state, ctx->height, ctx->width)) {
+    ctx->event_handler(ctx, LYS_PROGRAM_RELOADED);
+  }
+#endif
+
+  int64_t now = lys_wall_time();
+  if (ctx->interactive && !ctx->fixed_delta) {
+    ctx->delta = ((float)(now - ctx->last_time))/1000000.0;
+  } else {
+    ctx->delta = 1/(double)ctx->max_fps;
+  }
+  ctx->fps = (ctx->fps*0.9 + (1/ctx->delta)*0.1);
+  ctx->last_time = now;
+}
+
+void lys_step_render_async(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  // With a CPU backend the frame is read straight from the array
+  // rendered by Futhark, unless it goes to shared memory.
+#ifdef LYS_HOST_FRAMES
+  uint32_t *dest = NULL;
+#else
+  uint32_t *dest = ctx->rgbs;
+#endif
+  if (ctx->shm != NULL) {
+    dest = lys_shm_begin(ctx->shm, ctx->width, ctx->height);
+  }
+  lys_frame_job_start(&ctx->job, ctx->state, ctx->delta, dest);
+  ctx->state = NULL;
+  ctx->in_flight = true;
+}
+
+bool lys_frame_ready(struct lys_context *ctx) {
+  return !ctx->in_flight || lys_frame_job_done(&ctx->job);
+}
+
+void lys_await_frame(struct lys_context *ctx) {
+  if (!ctx->in_flight) {
+    return;
+  }
+  ctx->state = lys_frame_job_await(&ctx->job);
+  ctx->frame = ctx->job.frame;
+  ctx->in_flight = false;
+  if (ctx->shm != NULL) {
+    lys_shm_publish(ctx->shm);
+  }
+}
+
+void lys_present_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  int nrows = ctx->height/2;
+  int ncols = ctx->width;
+  int num_bands = (nrows + LYS_BAND_ROWS - 1) / LYS_BAND_ROWS;
+  pool_run(ctx->pool, ctx, render_band, num_bands);
+  ctx->event_handler(ctx, LYS_LOOP_ITERATION);
+  if (ctx->interactive) {
+    cursor_goto(0,0);
+  }
+  reserve_bands(ctx, num_bands);
+  pool_run(ctx->pool, ctx, display_band, num_bands);
+  write_bands(ctx->out, ctx->bands, num_bands);
+  size_t changes = 0;
+  for (int band = 0; band < num_bands; band++) {
+    changes += ctx->bands[band].changes;
+  }
+  size_t truecolour_bytes =
+    changes * LYS_TRUECOLOUR_CHANGE_BYTES + (size_t)nrows * ncols * 3;
+
+  // Only switch back to truecolour with some margin, so that frames
+  // near the budget do not flip between modes.
+  if (ctx->colour_mode == LYS_COLOUR_AUTO) {
+    if (!ctx->use_256 && truecolour_bytes > ctx->frame_budget) {
+      ctx->use_256 = true;
+    } else if (ctx->use_256 && truecolour_bytes < ctx->frame_budget / 4 * 3) {
+      ctx->use_256 = false;
     }
-    ctx->fps = (ctx->fps*0.9 + (1/delta)*0.1);
-    ctx->last_time = now;
-    struct futhark_opaque_state *new_state, *old_state = ctx->state;
-    FUT_CHECK(ctx->fut, futhark_entry_step(ctx->fut, &new_state, delta, old_state));
-    ctx->state = new_state;
-
-    struct futhark_u32_2d *out_arr;
-    FUT_CHECK(ctx->fut, futhark_entry_render(ctx->fut, &out_arr, ctx->state));
-    FUT_CHECK(ctx->fut, futhark_values_u32_2d(ctx->fut, out_arr, ctx->rgbs));
-    FUT_CHECK(ctx->fut, futhark_context_sync(ctx->fut));
-    FUT_CHECK(ctx->fut, futhark_free_u32_2d(ctx->fut, out_arr));
-    FUT_CHECK(ctx->fut, futhark_free_opaque_state(ctx->fut, old_state));
-
-    {
-      // Ideally we should only check for resize if WIGWINCH has been
-      // received, but this ioctl is pretty fast anyway.
-      maybe_resize(ctx);
-      int nrows = ctx->height/2;
-      int ncols = ctx->width;
-      render(nrows, ncols, ctx->rgbs, ctx->fgs, ctx->bgs, ctx->chars);
-      ctx->event_handler(ctx, LYS_LOOP_ITERATION);
-      if (ctx->interactive) {
-        cursor_goto(0,0);
-      }
-      display(ctx->out, !ctx->interactive, nrows, ncols, ctx->fgs, ctx->bgs, ctx->chars);
+  }
+
+  lys_frame_job_presented(&ctx->job, &ctx->latency);
+}
+
+void lys_close(struct lys_context *ctx) {
+  lys_await_frame(ctx);
+
+  ctx->event_handler(ctx, LYS_LOOP_END);
+
+  // Our cleanup.
+  lys_frame_job_free(&ctx->job);
+  lys_buffer_free(&ctx->rgbs_buffer);
+  lys_buffer_free(&ctx->fgs_buffer);
+  lys_buffer_free(&ctx->bgs_buffer);
+  lys_buffer_free(&ctx->chars_buffer);
+  for (int band = 0; band < ctx->num_bands; band++) {
+    lys_buffer_free(&ctx->bands[band].buffer);
+  }
+  free(ctx->bands);
+  pool_free(ctx->pool);
+  lys_free_state(ctx->fut, ctx->state);
+}
+
+void lys_run_console(struct lys_context *ctx) {
+  lys_open(ctx);
+
+  while (ctx->running && ctx->num_frames-- > 0) {
+    lys_begin_frame(ctx);
+    // When idle, the last frame is drawn again without being computed,
+    // and we sleep until input arrives.
+    bool idle = lys_frame_job_idle(&ctx->job);
+    if (!idle) {
+      lys_step_render_async(ctx);
+      lys_await_frame(ctx);
     }
-    if (ctx->interactive) {
-      fflush(stdout);
-      check_input(ctx);
+    lys_present_frame(ctx);
 
-      int delay =  1000.0/ctx->max_fps - delta*1000.0;
-      if (delay > 0) {
-        usleep(delay*1000);
+    if (ctx->interactive) {
+      int delay =  1000.0/ctx->max_fps - ctx->delta*1000.0;
+      if (idle) {
+        delay = LYS_IDLE_TIMEOUT_MS;
       }
+      wait_for_input(ctx, delay > 0 ? delay*1000 : 0, idle || ctx->latency_priority);
+      check_input(ctx);
 
       def();
     }
   }
 
-  ctx->event_handler(ctx, LYS_LOOP_END);
-
-  // Our cleanup.
-  free(ctx->rgbs);
-  free(ctx->fgs);
-  free(ctx->bgs);
-  free(ctx->chars);
-  FUT_CHECK(ctx->fut, futhark_free_opaque_state(ctx->fut, ctx->state));
+  lys_close(ctx);
 }
 
 void lys_setup(struct lys_context *ctx, int max_fps, int num_frames, FILE* out, int width, int height) {
@@ -293,12 +818,22 @@ void lys_setup(struct lys_context *ctx, int max_fps, int num_frames, FILE* out,
   ctx->max_fps = max_fps;
   ctx->num_frames = num_frames;
   ctx->interactive = out == NULL;
+  ctx->colour_mode = ctx->interactive ? LYS_COLOUR_AUTO : LYS_COLOUR_TRUE;
+  ctx->frame_budget = LYS_DEFAULT_FRAME_BUDGET;
 
   if (ctx->interactive) {
     int nrows, ncols;
     get_terminal_size(&nrows, &ncols);
     assert(nrows >= 0 && ncols >= 0);
     raw_mode();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
     ctx->width = ncols;
     ctx->height = nrows*2;
     ctx->out = stdout;
@@ -308,11 +843,7 @@ void lys_setup(struct lys_context *ctx, int max_fps, int num_frames, FILE* out,
     ctx->height = height;
   }
 
-  ctx->fgs = malloc(ctx->width * ctx->height * sizeof(uint32_t));
-  ctx->bgs = malloc(ctx->width * ctx->height * sizeof(uint32_t));
-  ctx->chars = malloc(ctx->width * ctx->height * sizeof(char));
-  ctx->rgbs = malloc(ctx->width*ctx->height*sizeof(uint32_t));
-  ctx->key_pressed = 0;
+  alloc_buffers(ctx);
 }
 
 void draw_text(struct lys_context *ctx, char* buffer, int32_t colour,
@@ -10,15 +10,41 @@
 #include PROGHEADER
 
 #include "shared.h"
+#include "shm.h"
 
 enum lys_event {
   LYS_LOOP_START,
   LYS_LOOP_ITERATION,
   LYS_LOOP_END,
   LYS_WINDOW_SIZE_UPDATED,
-  LYS_F1
+  LYS_F1,
+  LYS_F2,
+  // The program was rebuilt and reloaded (LYS_HOT_RELOAD).
+  LYS_PROGRAM_RELOADED
 };
 
+// Maximum number of bytes of terminal input handled per frame.
+#define LYS_INPUT_BUFFER_SIZE 256
+
+// How colours are sent to the terminal.  LYS_COLOUR_256 uses the xterm
+// 256-colour palette, which is shorter to send and supported by more
+// terminals.  LYS_COLOUR_AUTO uses truecolour unless a frame would take
+// more than the frame budget in bytes.
+enum lys_colour_mode {
+  LYS_COLOUR_TRUE,
+  LYS_COLOUR_256,
+  LYS_COLOUR_AUTO
+};
+
+#define LYS_DEFAULT_FRAME_BUDGET (128*1024)
+
+// Upper bound on the number of threads encoding a frame when
+// 'encode_threads' is left at 0.
+#define LYS_MAX_ENCODE_THREADS 8
+
+struct lys_pool;
+struct lys_band;
+
 struct lys_context {
   struct futhark_context *fut;
   struct futhark_opaque_state *state;
@@ -37,15 +63,93 @@ struct lys_context {
   int num_frames;
   void* event_handler_data;
   void (*event_handler)(struct lys_context*, enum lys_event);
-  int key_pressed;
+  int keys_pressed[LYS_INPUT_BUFFER_SIZE];
+  int num_keys_pressed;
+  unsigned char input[LYS_INPUT_BUFFER_SIZE];
+  int input_len;
+  int64_t input_time;
+  // Arrival time of the key being submitted, or 0 for now.
+  int64_t event_time;
+  struct lys_latency latency;
   bool interactive;
   FILE* out;
+  // If non-NULL, frames are rendered into this shared memory ring
+  // rather than into 'rgbs'.
+  struct lys_shm *shm;
+  float delta;
+  uint32_t *frame;
+  bool in_flight;
+  struct lys_frame_job job;
+  struct lys_buffer fgs_buffer;
+  struct lys_buffer bgs_buffer;
+  struct lys_buffer chars_buffer;
+  struct lys_buffer rgbs_buffer;
+  struct lys_resize resize;
+  // Set these before lys_open().  'dither' applies ordered dithering
+  // when quantising to 256 colours.
+  enum lys_colour_mode colour_mode;
+  bool dither;
+  size_t frame_budget;
+  bool use_256;
+  // Set before lys_open() to start the next frame as soon as input
+  // arrives, rather than sleeping until it is due.
+  bool latency_priority;
+  // Set before lys_open() to step by 1/max_fps every frame even when
+  // interactive, so that a run can be repeated exactly.
+  bool fixed_delta;
+  // Set before lys_open() to the number of threads rendering and
+  // encoding frames, or 0 for one per CPU up to LYS_MAX_ENCODE_THREADS.
+  int encode_threads;
+  struct lys_pool *pool;
+  struct lys_band *bands;
+  int num_bands;
 };
 
 void lys_setup(struct lys_context *ctx, int max_fps, int num_frames, FILE *output, int width, int height);
 
+// Runs the whole interactive (or headless) loop, and is all most
+// programs need.  It is built from the functions below, which can also
+// be used to drive frames from another event loop:
+//
+//   lys_open(ctx);
+//   while (...) {
+//     lys_begin_frame(ctx);
+//     lys_submit_key(ctx, ...);   // At any time, also while in flight.
+//     lys_step_render_async(ctx);
+//     ...                         // Other work; lys_frame_ready() polls.
+//     lys_await_frame(ctx);
+//     lys_present_frame(ctx);
+//   }
+//   lys_close(ctx);
+//
+// Between lys_step_render_async() and lys_await_frame() the frame is
+// in flight: the state is owned by a background thread and the
+// Futhark context must not be used by anyone else.
 void lys_run_console(struct lys_context *ctx);
 
+void lys_open(struct lys_context *ctx);
+
+// Measures the time since the last frame and handles terminal resizes.
+void lys_begin_frame(struct lys_context *ctx);
+
+// Queue a key event (e is 0 for keydown, 1 for keyup) for the next step.
+void lys_submit_key(struct lys_context *ctx, int e, int keysym);
+
+// Read pending terminal input and submit it as key events.
+void check_input(struct lys_context *ctx);
+
+// Apply the submitted events, step and render in the background.
+void lys_step_render_async(struct lys_context *ctx);
+
+bool lys_frame_ready(struct lys_context *ctx);
+
+void lys_await_frame(struct lys_context *ctx);
+
+// Draw the frame (and the text overlay) to the terminal.
+void lys_present_frame(struct lys_context *ctx);
+
+void lys_close(struct lys_context *ctx);
+
 void draw_text(struct lys_context *ctx, char* buffer, int32_t colour,
                int x_start, int y_start);
 
@@ -1,5 +1,6 @@
 #include "liblys.h"
 #include PRINTFHEADER
+#include "metrics.h"
 
 #include <unistd.h>
 #include <getopt.h>
@@ -8,30 +9,118 @@
 
 bool show_text = true;
 
+// For benchmarking: record frame times, and submit synthetic key
+// presses to exercise the event path.
+const char *bench_output = NULL;
+int synthetic_events = 0;
+struct lys_bench bench;
+
+// Live kernel profiling (-P), and the statistics overlay toggled with
+// F2.
+const char *profile_output = NULL;
+struct lys_profile profile;
+bool show_stats = false;
+char *stats_buffer = NULL;
+size_t stats_buffer_len = 0;
+
+// Thread placement (-a, -A), and frame jitter for the overlay and -B.
+const char *frontend_cpus = NULL;
+const char *worker_cpus = NULL;
+
+// Start frames as soon as input arrives (-L).
+bool latency_priority = false;
+
+// Memory use, and the budget (-M) beyond which we stop.
+struct lys_memory memory;
+int64_t memory_budget = 0;
+bool memory_exceeded = false;
+
+// Golden frame hashes, recorded to (-H) or checked against (-V) a file.
+const char *golden_path = NULL;
+bool golden_verify = false;
+struct lys_golden golden;
+
+// Counters served for monitoring (-m).
+const char *metrics_address = NULL;
+struct lys_metrics_server *metrics_server = NULL;
+struct lys_frame_stats frame_stats;
+
+void bench_iteration(struct lys_context *ctx) {
+  if (bench_output != NULL) {
+    lys_bench_frame(&bench);
+  }
+  for (int i = 0; i < synthetic_events; i++) {
+    int key = 'a' + i % 26;
+    lys_submit_key(ctx, 0, key);
+    lys_submit_key(ctx, 1, key);
+  }
+}
+
 void loop_start(struct lys_context *ctx, struct lys_text *text) {
   prepare_text(ctx->fut, text);
   text->show_text = show_text;
+  stats_buffer_len = text->text_buffer_len + LYS_STATS_BUFFER_SIZE;
+  stats_buffer = malloc(stats_buffer_len);
+  assert(stats_buffer != NULL);
 }
 
 void loop_iteration(struct lys_context *ctx, struct lys_text *text) {
-  if (!text->show_text) {
+  lys_frame_stats_frame(&frame_stats);
+  lys_metrics_frame(ctx->job.idle);
+  if (golden_path != NULL) {
+    char label[32];
+    snprintf(label, sizeof(label), "%ld", (long)golden.frames);
+    if (!lys_golden_frame(&golden, label, ctx->frame, ctx->height, ctx->width)) {
+      ctx->running = 0;
+    }
+  }
+  if (profile_output != NULL) {
+    lys_profile_frame(&profile, ctx->fut);
+  }
+  if ((memory_budget > 0 || show_stats || metrics_server != NULL) &&
+      !lys_memory_frame(&memory, ctx->fut, profile_output != NULL ? &profile : NULL)) {
+    memory_exceeded = true;
+    ctx->running = 0;
+  }
+  if (!text->show_text && !show_stats) {
+#ifdef LYS_DEVICE_TEXT
+    lys_frame_job_set_text(&ctx->job, "", 0, ctx->height, ctx->width);
+#endif
     return;
   }
 
-  build_text(ctx, text->text_buffer, text->text_buffer_len, text->text_format,
-             ctx->fps, text->sum_names);
-  if (*(text->text_buffer) != '\0') {
-    int32_t text_colour;
+  char *overlay = text->text_buffer;
+  if (text->show_text) {
+    build_text(ctx, text->text_buffer, text->text_buffer_len, text->text_format,
+               ctx->fps, text->sum_names);
+  } else {
+    text->text_buffer[0] = '\0';
+  }
+  if (show_stats) {
+    lys_build_stats(stats_buffer, stats_buffer_len, text->text_buffer,
+                    &frame_stats, &ctx->latency, &memory,
+                    profile_output != NULL ? &profile : NULL);
+    overlay = stats_buffer;
+  }
+  int32_t text_colour = 0;
+  if (*overlay != '\0') {
     FUT_CHECK(ctx->fut,
               futhark_entry_text_colour(ctx->fut, (uint32_t*) &text_colour,
                                         ctx->state));
-    draw_text(ctx, text->text_buffer, text_colour, 1, 1);
+#ifndef LYS_DEVICE_TEXT
+    draw_text(ctx, overlay, text_colour, 1, 1);
+#endif
   }
+#ifdef LYS_DEVICE_TEXT
+  // Composited into the following frames by the Futhark program.
+  lys_frame_job_set_text(&ctx->job, overlay, text_colour, ctx->height, ctx->width);
+#endif
 }
 
 void loop_end(struct lys_text *text) {
   free(text->text_format);
   free(text->text_buffer);
+  free(stats_buffer);
 
   for (size_t i = 0; i < n_printf_arguments(); i++) {
     if (text->sum_names[i] != NULL) {
@@ -50,6 +139,18 @@ void f1(struct lys_text *text) {
   text->show_text = !text->show_text;
 }
 
+void f2(void) {
+  show_stats = !show_stats;
+}
+
+// The text format may have changed, so prepare it again.
+void program_reloaded(struct lys_context *ctx, struct lys_text *text) {
+  bool show = text->show_text;
+  loop_end(text);
+  loop_start(ctx, text);
+  text->show_text = show;
+}
+
 void handle_event(struct lys_context *ctx, enum lys_event event) {
   struct lys_text *text = (struct lys_text *) ctx->event_handler_data;
   switch (event) {
@@ -58,6 +159,7 @@ void handle_event(struct lys_context *ctx, enum lys_event event) {
     break;
   case LYS_LOOP_ITERATION:
     loop_iteration(ctx, text);
+    bench_iteration(ctx);
     break;
   case LYS_LOOP_END:
     loop_end(text);
@@ -66,6 +168,12 @@ void handle_event(struct lys_context *ctx, enum lys_event event) {
     break;
   case LYS_F1:
     f1(text);
+    break;
+  case LYS_F2:
+    f2();
+    break;
+  case LYS_PROGRAM_RELOADED:
+    program_reloaded(ctx, text);
   }
 }
 
@@ -80,6 +188,26 @@ void usage(char **argv) {
   puts("  -t      Do not show text by default.");
   puts("  -i      Select execution device interactively.");
   puts("  -n FILE Render frames to FILE.");
+  puts("  -w INT  Frame width when rendering to a file.");
+  puts("  -h INT  Frame height when rendering to a file.");
+  puts("  -E INT  Submit this many synthetic key presses per frame.");
+  puts("  -B FILE Write frame time statistics to FILE as JSON.");
+  puts("  -P FILE Profile kernels, and write a report to FILE.");
+  puts("  -a CPUS Run the frontend on these CPUs, such as 0-3,8.");
+  puts("  -A CPUS Run the Futhark code on these CPUs.");
+  puts("  -L      Start frames as soon as input arrives, for lower latency.");
+  puts("  -M MIB  Stop if Futhark and frame buffers use more memory.");
+  puts("  -m ADDR Serve metrics on this localhost port, or unix:PATH.");
+  puts("  -s INT  Seed of the state (default: the time, or 0 with -H or -V).");
+  puts("  -H FILE Record hashes of the frames to FILE.");
+  puts("  -V FILE Check the frames against the hashes in FILE.");
+  puts("  -S SHM  Also publish frames in shared memory, given as NAME[:SLOTS].");
+  puts("  -c MODE Colours: 'true', '256', or 'auto' (default when interactive).");
+  puts("  -D      Dither when using 256 colours.");
+  printf("  -b INT  Bytes per frame before 'auto' uses 256 colours (default %d).\n",
+         LYS_DEFAULT_FRAME_BUDGET);
+  printf("  -T INT  Threads encoding frames (default: one per CPU, up to %d).\n",
+         LYS_MAX_ENCODE_THREADS);
 }
 
 int main(int argc, char** argv) {
@@ -90,9 +218,18 @@ int main(int argc, char** argv) {
   int width = 74;
   int height = 25*2;
   int num_frames = -1;
+  char *shmopt = NULL;
+  int colour_mode = -1;
+  bool dither = false;
+  int frame_budget = LYS_DEFAULT_FRAME_BUDGET;
+  int encode_threads = 0;
+  int32_t seed = (int32_t) lys_wall_time();
+  bool seed_given = false;
+  long long seed_arg;
+  char *end;
 
   int c;
-  while ( (c = getopt(argc, argv, "r:Rtd:in:f:")) != -1) {
+  while ( (c = getopt(argc, argv, "r:Rtd:in:f:S:w:h:E:B:P:c:Db:a:A:LM:m:T:s:H:V:")) != -1) {
     switch (c) {
     case 'r':
       max_fps = atoi(optarg);
@@ -124,6 +261,102 @@ int main(int argc, char** argv) {
         exit(1);
       }
       break;
+    case 'S':
+      shmopt = optarg;
+      break;
+    case 'w':
+      width = atoi(optarg);
+      if (width <= 0) {
+        fprintf(stderr, "'%s' is not a valid width.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      height = atoi(optarg);
+      if (height <= 0) {
+        fprintf(stderr, "'%s' is not a valid height.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'E':
+      synthetic_events = atoi(optarg);
+      if (synthetic_events < 0) {
+        fprintf(stderr, "'%s' is not a number of events.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'B':
+      bench_output = optarg;
+      break;
+    case 'P':
+      profile_output = optarg;
+      break;
+    case 'a':
+      frontend_cpus = optarg;
+      break;
+    case 'A':
+      worker_cpus = optarg;
+      break;
+    case 'L':
+      latency_priority = true;
+      break;
+    case 'm':
+      metrics_address = optarg;
+      break;
+    case 's':
+      seed_arg = strtoll(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' ||
+          seed_arg < INT32_MIN || seed_arg > UINT32_MAX) {
+        fprintf(stderr, "'%s' is not a valid seed.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      seed = (int32_t)seed_arg;
+      seed_given = true;
+      break;
+    case 'H':
+      golden_path = optarg;
+      golden_verify = false;
+      break;
+    case 'V':
+      golden_path = optarg;
+      golden_verify = true;
+      break;
+    case 'M':
+      memory_budget = atoll(optarg) * 1024 * 1024;
+      if (memory_budget <= 0) {
+        fprintf(stderr, "'%s' is not a valid number of MiB.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      if (strcmp(optarg, "true") == 0) {
+        colour_mode = LYS_COLOUR_TRUE;
+      } else if (strcmp(optarg, "256") == 0) {
+        colour_mode = LYS_COLOUR_256;
+      } else if (strcmp(optarg, "auto") == 0) {
+        colour_mode = LYS_COLOUR_AUTO;
+      } else {
+        fprintf(stderr, "Use -c <true|256|auto>\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'D':
+      dither = true;
+      break;
+    case 'b':
+      frame_budget = atoi(optarg);
+      if (frame_budget <= 0) {
+        fprintf(stderr, "'%s' is not a valid number of bytes.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'T':
+      encode_threads = atoi(optarg);
+      if (encode_threads <= 0) {
+        fprintf(stderr, "'%s' is not a valid number of threads.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     case '?':
       usage(argv);
       return EXIT_SUCCESS;
@@ -153,16 +386,58 @@ int main(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
 
+  // Before anything is allocated, so that it is first touched on the
+  // frontend's NUMA node.
+  if (!lys_set_placement(frontend_cpus, worker_cpus)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // A golden run must be the same every time, and the text overlay
+  // shows the frame rate.
+  if (golden_path != NULL) {
+    if (!lys_golden_open(&golden, golden_path, golden_verify)) {
+      exit(EXIT_FAILURE);
+    }
+    if (!seed_given) {
+      seed = 0;
+    }
+    show_text = false;
+  }
+
+  lys_metrics_init(max_fps);
+  if (metrics_address != NULL) {
+    metrics_server = lys_metrics_serve(metrics_address);
+    if (metrics_server == NULL) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
   void* buf = malloc(1024*1024);
   setvbuf(stdout, buf, _IOFBF, 1024*1024);
 
   struct lys_context ctx;
   struct futhark_context_config *futcfg;
   lys_setup(&ctx, max_fps, num_frames, output, width, height);
+  ctx.latency_priority = latency_priority;
+  if (colour_mode >= 0) {
+    ctx.colour_mode = colour_mode;
+  }
+  ctx.dither = dither;
+  ctx.frame_budget = frame_budget;
+  ctx.encode_threads = encode_threads;
+  ctx.fixed_delta = golden_path != NULL;
+
+  if (shmopt != NULL) {
+    ctx.shm = lys_shm_create_from_option(shmopt);
+    if (ctx.shm == NULL) {
+      return EXIT_FAILURE;
+    }
+  }
 
   char* opencl_device_name = NULL;
   lys_setup_futhark_context(argv[0],
                             deviceopt, device_interactive,
+                            profile_output != NULL,
                             &futcfg, &ctx.fut, &opencl_device_name);
   if (opencl_device_name != NULL) {
     free(opencl_device_name);
@@ -172,12 +447,52 @@ int main(int argc, char** argv) {
   ctx.event_handler_data = &text;
   ctx.event_handler = handle_event;
 
-  int32_t seed = (int32_t) lys_wall_time();
   futhark_entry_init(ctx.fut, &ctx.state, seed, ctx.height, ctx.width);
+  lys_state_created();
+  lys_bench_init(&bench);
+  lys_profile_init(&profile);
+  lys_frame_stats_init(&frame_stats);
+  lys_memory_init(&memory, memory_budget);
   lys_run_console(&ctx);
 
+  if (profile_output != NULL &&
+      lys_profile_write(&profile, ctx.fut, profile_output) != 0) {
+    return EXIT_FAILURE;
+  }
+  lys_profile_free(&profile);
+
+  if (bench_output != NULL) {
+    lys_memory_sample(&memory, ctx.fut, NULL);
+  }
+  if (bench_output != NULL && lys_bench_write(&bench, bench_output, argv[0], &frame_stats, &ctx.latency, &memory) != 0) {
+    return EXIT_FAILURE;
+  }
+  lys_bench_free(&bench);
+
+  if (ctx.latency.num_samples > 0) {
+    fprintf(stderr, "Input-to-display latency over the last %d frames with input: p50 %.1fms, p99 %.1fms\n",
+            ctx.latency.num_samples,
+            lys_latency_percentile(&ctx.latency, 50)/1000.0,
+            lys_latency_percentile(&ctx.latency, 99)/1000.0);
+  }
+
+  if (golden_path != NULL) {
+    if (golden_verify && !golden.failed) {
+      fprintf(stderr, "All %ld frames match %s.\n", (long)golden.frames, golden_path);
+    }
+    lys_golden_close(&golden);
+  }
+
+  if (ctx.shm != NULL) {
+    lys_shm_free(ctx.shm);
+  }
+
+  if (metrics_server != NULL) {
+    lys_metrics_server_free(metrics_server);
+  }
+
   futhark_context_free(ctx.fut);
   futhark_context_config_free(futcfg);
 
-  return EXIT_SUCCESS;
+  return memory_exceeded || golden.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,89 @@
+// Bakes the printable ASCII characters of a font into a bitmap atlas
+// for device-side text (LYS_DEVICE_TEXT=1, see common.mk).  Every
+// glyph gets a cell of the same size, as the font is monospaced, which
+// holds its coverage from 0 to 255.  The atlas is written to standard
+// output as a C header, and uploaded to the device by shared.c.
+//
+// Usage: font_atlas FONT PIXEL_SIZE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#define FIRST_CHAR 32
+#define LAST_CHAR 126
+
+// FreeType metrics are in 26.6 fixed point.
+static int pixels(long x) {
+  return (int)((x + 63) >> 6);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3 || atoi(argv[2]) <= 0) {
+    fprintf(stderr, "Usage: %s FONT PIXEL_SIZE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FT_Library library;
+  FT_Face face;
+  if (FT_Init_FreeType(&library) != 0 ||
+      FT_New_Face(library, argv[1], 0, &face) != 0 ||
+      FT_Set_Pixel_Sizes(face, 0, atoi(argv[2])) != 0) {
+    fprintf(stderr, "%s: cannot load %s\n", argv[0], argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  int ascent = pixels(face->size->metrics.ascender);
+  int height = ascent + pixels(-face->size->metrics.descender);
+  if (FT_Load_Char(face, 'M', FT_LOAD_DEFAULT) != 0) {
+    fprintf(stderr, "%s: %s has no 'M'\n", argv[0], argv[1]);
+    return EXIT_FAILURE;
+  }
+  int width = pixels(face->glyph->advance.x);
+
+  int num_glyphs = LAST_CHAR - FIRST_CHAR + 1;
+  unsigned char *atlas = calloc((size_t)num_glyphs * height * width, 1);
+  if (atlas == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  for (int c = FIRST_CHAR; c <= LAST_CHAR; c++) {
+    if (FT_Load_Char(face, c, FT_LOAD_RENDER) != 0) {
+      fprintf(stderr, "%s: cannot render '%c'\n", argv[0], c);
+      return EXIT_FAILURE;
+    }
+    FT_GlyphSlot glyph = face->glyph;
+    FT_Bitmap *bitmap = &glyph->bitmap;
+    unsigned char *cell = atlas + (size_t)(c - FIRST_CHAR) * height * width;
+    // Place the bitmap relative to the baseline, clipped to the cell.
+    for (unsigned int r = 0; r < bitmap->rows; r++) {
+      int y = ascent - glyph->bitmap_top + (int)r;
+      for (unsigned int k = 0; k < bitmap->width; k++) {
+        int x = glyph->bitmap_left + (int)k;
+        if (y >= 0 && y < height && x >= 0 && x < width) {
+          cell[y * width + x] = bitmap->buffer[r * bitmap->pitch + k];
+        }
+      }
+    }
+  }
+
+  printf("// Generated by font_atlas.c from %s at %s pixels.\n", argv[1], argv[2]);
+  printf("#define LYS_FONT_ATLAS_FIRST %d\n", FIRST_CHAR);
+  printf("#define LYS_FONT_ATLAS_GLYPHS %d\n", num_glyphs);
+  printf("#define LYS_FONT_ATLAS_HEIGHT %d\n", height);
+  printf("#define LYS_FONT_ATLAS_WIDTH %d\n", width);
+  printf("static const unsigned char lys_font_atlas[] = {");
+  size_t n = (size_t)num_glyphs * height * width;
+  for (size_t i = 0; i < n; i++) {
+    printf("%s%d%s", i % 16 == 0 ? "\n  " : "", atlas[i], i + 1 < n ? "," : "");
+  }
+  printf("\n};\n");
+
+  free(atlas);
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  return EXIT_SUCCESS;
+}
@@ -3,14 +3,24 @@
 import sys
 import re
 
-self_dir, out_file, in_file = sys.argv[1:]
+def text_content_types(in_file):
+    with open(in_file) as f:
+        contents = f.read()
+    start = contents.find('futhark_entry_text_content')
+    end = contents.find(')', start)
+    return re.findall(r'([^ ]+) \*out\d+,', contents[start:end])
+
+# With --signature, write the output types of text_content as a C
+# string, which a hot reloaded library must match (see shared.c).
+if sys.argv[1] == '--signature':
+    out_file, in_file = sys.argv[2:]
+    with open(out_file, 'w') as f:
+        print('const char lys_text_content_signature[] = "{}";'.format(' '.join(text_content_types(in_file))), file=f)
+    sys.exit(0)
 
-with open(in_file) as f:
-    contents = f.read()
+self_dir, out_file, in_file = sys.argv[1:]
 
-start = contents.find('futhark_entry_text_content')
-end = contents.find(')', start)
-types = re.findall(r'([^ ]+) \*out\d+,', contents[start:end])
+types = text_content_types(in_file)
 out_vars = ['out{}'.format(i) for i in range(len(types))]
 
 with open(out_file, 'w') as f:
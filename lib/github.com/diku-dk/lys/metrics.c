@@ -0,0 +1,193 @@
+#include "metrics.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+// How often the serving thread checks whether it should stop.
+#define LYS_METRICS_POLL_MS 250
+#define LYS_METRICS_RESPONSE_SIZE 8192
+
+struct lys_metrics_server {
+  pthread_t thread;
+  int listen_fd;
+  char *unix_path;
+  _Atomic bool stop;
+};
+
+static int64_t load(_Atomic int64_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Formats the metrics into 'out', and returns their length.
+static size_t format_metrics(char *out, size_t len) {
+  struct lys_metrics *m = &lys_metrics;
+  size_t used = 0;
+#define PUT(...)                                                        \
+  if (used < len) {                                                     \
+    used += snprintf(out + used, len - used, __VA_ARGS__);              \
+  }
+
+  PUT("# HELP lys_frames_total Frames shown.\n"
+      "# TYPE lys_frames_total counter\n"
+      "lys_frames_total %ld\n", (long)load(&m->frames));
+  PUT("# HELP lys_dropped_frames_total Frames due at the target rate that were not shown.\n"
+      "# TYPE lys_dropped_frames_total counter\n"
+      "lys_dropped_frames_total %ld\n", (long)load(&m->dropped_frames));
+
+  PUT("# HELP lys_frame_seconds Time between frames.\n"
+      "# TYPE lys_frame_seconds histogram\n");
+  int64_t count = 0;
+  for (int i = 0; i <= LYS_METRICS_BUCKETS; i++) {
+    count += load(&m->frame_buckets[i]);
+    if (i < LYS_METRICS_BUCKETS) {
+      PUT("lys_frame_seconds_bucket{le=\"%g\"} %ld\n",
+          lys_metrics_bucket_us[i] / 1e6, (long)count);
+    } else {
+      PUT("lys_frame_seconds_bucket{le=\"+Inf\"} %ld\n", (long)count);
+    }
+  }
+  PUT("lys_frame_seconds_sum %f\n", load(&m->frame_us) / 1e6);
+  PUT("lys_frame_seconds_count %ld\n", (long)count);
+
+  PUT("# HELP lys_entry_calls_total Calls of each Futhark entry point.\n"
+      "# TYPE lys_entry_calls_total counter\n");
+  for (int i = 0; i < LYS_NUM_ENTRIES; i++) {
+    PUT("lys_entry_calls_total{entry=\"%s\"} %ld\n",
+        lys_entry_names[i], (long)load(&m->entry_calls[i]));
+  }
+  PUT("# HELP lys_entry_seconds_total Time spent in each Futhark entry point.\n"
+      "# TYPE lys_entry_seconds_total counter\n");
+  for (int i = 0; i < LYS_NUM_ENTRIES; i++) {
+    PUT("lys_entry_seconds_total{entry=\"%s\"} %f\n",
+        lys_entry_names[i], load(&m->entry_us[i]) / 1e6);
+  }
+  PUT("# HELP lys_resizes_total Resizes of the state.\n"
+      "# TYPE lys_resizes_total counter\n"
+      "lys_resizes_total %ld\n", (long)load(&m->entry_calls[LYS_ENTRY_RESIZE]));
+
+  PUT("# HELP lys_context_peak_bytes Peak memory use of the Futhark context.\n"
+      "# TYPE lys_context_peak_bytes gauge\n"
+      "lys_context_peak_bytes %ld\n", (long)load(&m->context_peak));
+  PUT("# HELP lys_host_bytes Host memory of the frame buffers.\n"
+      "# TYPE lys_host_bytes gauge\n"
+      "lys_host_bytes %ld\n", (long)load(&m->host));
+  PUT("# HELP lys_states Opaque states alive.\n"
+      "# TYPE lys_states gauge\n"
+      "lys_states %ld\n", (long)load(&m->states));
+#undef PUT
+  return used < len ? used : len - 1;
+}
+
+// Every request gets the metrics, whatever its path, and the
+// connection is closed after the response.
+static void serve_client(int fd) {
+  char request[1024];
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  if (poll(&pfd, 1, LYS_METRICS_POLL_MS) > 0 && read(fd, request, sizeof(request)) < 0) {
+    return;
+  }
+
+  char response[LYS_METRICS_RESPONSE_SIZE];
+  char body[LYS_METRICS_RESPONSE_SIZE - 256];
+  size_t body_len = format_metrics(body, sizeof(body));
+  int len = snprintf(response, sizeof(response),
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n"
+                     "%s", body_len, body);
+  // The client may have gone away, which must not kill us.
+  size_t sent = 0;
+  size_t total = len < (int)sizeof(response) ? (size_t)len : sizeof(response) - 1;
+  while (sent < total) {
+    ssize_t res = send(fd, response + sent, total - sent, MSG_NOSIGNAL);
+    if (res <= 0) {
+      break;
+    }
+    sent += res;
+  }
+}
+
+static void* metrics_thread(void *arg) {
+  struct lys_metrics_server *server = arg;
+  struct pollfd pfd = { .fd = server->listen_fd, .events = POLLIN };
+  while (!atomic_load(&server->stop)) {
+    if (poll(&pfd, 1, LYS_METRICS_POLL_MS) <= 0) {
+      continue;
+    }
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd >= 0) {
+      serve_client(fd);
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+struct lys_metrics_server* lys_metrics_serve(const char *address) {
+  int fd;
+  char *unix_path = NULL;
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *path = address + 5;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", path);
+      return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    if (!lys_remove_stale_socket(path)) {
+      return NULL;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "Cannot bind %s: %s\n", path, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    unix_path = strdup(path);
+  } else {
+    char *end;
+    long port = strtol(address, &end, 10);
+    if (*address == '\0' || *end != '\0' || port <= 0 || port > 65535) {
+      fprintf(stderr, "'%s' is neither a port nor unix:PATH.\n", address);
+      return NULL;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "Cannot bind port %ld: %s\n", port, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+  }
+  assert(listen(fd, 4) == 0);
+
+  struct lys_metrics_server *server = calloc(1, sizeof(struct lys_metrics_server));
+  assert(server != NULL);
+  server->listen_fd = fd;
+  server->unix_path = unix_path;
+  assert(pthread_create(&server->thread, NULL, metrics_thread, server) == 0);
+  return server;
+}
+
+void lys_metrics_server_free(struct lys_metrics_server *server) {
+  atomic_store(&server->stop, true);
+  pthread_join(server->thread, NULL);
+  close(server->listen_fd);
+  if (server->unix_path != NULL) {
+    unlink(server->unix_path);
+    free(server->unix_path);
+  }
+  free(server);
+}
@@ -0,0 +1,21 @@
+// Serves the counters of struct lys_metrics (see shared.h) in the
+// Prometheus text format, over HTTP from a background thread, so that
+// programs left running unattended can be monitored.  Only the frame
+// loop's own atomic counters are read, so serving a request never
+// stalls a frame.
+
+#ifndef LIBLYS_METRICS
+#define LIBLYS_METRICS
+
+#include "shared.h"
+
+struct lys_metrics_server;
+
+// 'address' is a TCP port on localhost, or unix:PATH for a Unix
+// socket.  Returns NULL, after printing why, if it cannot be listened
+// on.
+struct lys_metrics_server* lys_metrics_serve(const char *address);
+
+void lys_metrics_server_free(struct lys_metrics_server *server);
+
+#endif
@@ -0,0 +1,621 @@
+// Frontend that serves frames to a viewer over a local socket instead
+// of drawing them itself.  See protocol.h for the wire format.
+
+#include "liblys.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const char *unix_socket_path = NULL;
+static volatile sig_atomic_t interrupted = 0;
+
+static void trigger_event(struct lys_context *ctx, enum lys_event event) {
+  ctx->event_handler(ctx, event);
+}
+
+static bool write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t res = send(fd, p, n, MSG_NOSIGNAL);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += res;
+    n -= res;
+  }
+  return true;
+}
+
+// XOR 'cur' against 'prev' and run-length encode the unchanged
+// stretches.  Returns the number of words written to 'out', or -1 if
+// the delta would not be smaller than a keyframe.
+static ssize_t encode_delta(const uint32_t *cur, const uint32_t *prev, size_t n,
+                            uint32_t *out) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    size_t skip = 0;
+    while (i < n && cur[i] == prev[i]) {
+      skip++;
+      i++;
+    }
+    if (i == n) {
+      break;
+    }
+    // A changed run ends at the first stretch of three unchanged
+    // pixels; shorter stretches are cheaper to send as zero words.
+    size_t start = i, end = i;
+    while (i < n) {
+      if (cur[i] != prev[i]) {
+        end = ++i;
+      } else if (i + 2 < n && cur[i+1] == prev[i+1] && cur[i+2] == prev[i+2]) {
+        break;
+      } else {
+        i++;
+      }
+    }
+    i = end;
+    size_t count = end - start;
+    if (o + 2 + count >= n) {
+      return -1;
+    }
+    out[o++] = skip;
+    out[o++] = count;
+    for (size_t j = start; j < end; j++) {
+      out[o++] = cur[j] ^ prev[j];
+    }
+  }
+  return o;
+}
+
+// Encode 'frame' as a delta or keyframe, and keep a copy of it to
+// encode the next one against.  After this the frame is not needed,
+// and the returned payload is in the encoder's own buffers.
+static const void* encoder_encode(struct lys_net_encoder *enc, const uint32_t *frame,
+                                  bool keyframe, struct lys_net_header *header) {
+  size_t n = (size_t)enc->width * enc->height;
+  *header = (struct lys_net_header)
+    { .seq = enc->seq++, .width = enc->width, .height = enc->height };
+  ssize_t words = -1;
+
+  if (!keyframe && enc->since_keyframe < enc->keyframe_interval) {
+    words = encode_delta(frame, enc->previous, n, enc->encoded);
+  }
+  memcpy(enc->previous, frame, n * sizeof(uint32_t));
+
+  if (words < 0) {
+    header->type = LYS_NET_KEYFRAME;
+    header->size = n * sizeof(uint32_t);
+    enc->since_keyframe = 0;
+    return enc->previous;
+  }
+  header->type = LYS_NET_DELTA;
+  header->size = words * sizeof(uint32_t);
+  enc->since_keyframe++;
+  return enc->encoded;
+}
+
+static bool encoder_send_text(struct lys_net_encoder *enc, int fd,
+                              const char *text, size_t len, uint32_t colour) {
+  struct lys_net_header header =
+    { .type = LYS_NET_TEXT, .size = sizeof(uint32_t) + len,
+      .seq = enc->seq, .width = enc->width, .height = enc->height };
+  return write_all(fd, &header, sizeof(header)) &&
+    write_all(fd, &colour, sizeof(colour)) &&
+    write_all(fd, text, len);
+}
+
+static void* encoder_thread(void *arg) {
+  struct lys_net_encoder *enc = arg;
+  char *text = NULL;
+  size_t text_capacity = 0;
+
+  pthread_mutex_lock(&enc->lock);
+  while (true) {
+    while (!enc->stop && !(enc->pending != NULL && enc->fd >= 0 && !enc->failed)) {
+      pthread_cond_wait(&enc->cond, &enc->lock);
+    }
+    if (enc->stop) {
+      break;
+    }
+
+    const uint32_t *frame = enc->pending;
+    enc->pending = NULL;
+
+    size_t text_len = enc->pending_text_len;
+    uint32_t text_colour = enc->pending_text_colour;
+    if (text_len > text_capacity) {
+      text_capacity = text_len;
+      text = realloc(text, text_capacity);
+      assert(text != NULL);
+    }
+    if (enc->pending_text != NULL) {
+      memcpy(text, enc->pending_text, text_len);
+    }
+
+    int fd = enc->fd;
+    bool keyframe = enc->keyframe_requested;
+    enc->keyframe_requested = false;
+    enc->busy = true;
+    enc->reading = true;
+    pthread_mutex_unlock(&enc->lock);
+
+    struct lys_net_header header;
+    const void *payload = encoder_encode(enc, frame, keyframe, &header);
+
+    pthread_mutex_lock(&enc->lock);
+    enc->reading = false;
+    pthread_cond_broadcast(&enc->cond);
+    pthread_mutex_unlock(&enc->lock);
+
+    bool sent = write_all(fd, &header, sizeof(header)) &&
+      write_all(fd, payload, header.size) &&
+      encoder_send_text(enc, fd, text, text_len, text_colour);
+    if (sent) {
+      enc->frames_sent++;
+      enc->bytes_sent += sizeof(header) + header.size;
+    }
+
+    pthread_mutex_lock(&enc->lock);
+    enc->failed = !sent;
+    enc->busy = false;
+    pthread_cond_broadcast(&enc->cond);
+  }
+  pthread_mutex_unlock(&enc->lock);
+
+  free(text);
+  return NULL;
+}
+
+// Must be called with the encoder lock held.  Waits until the encoder
+// thread is not touching the frame buffers or the socket.
+static void encoder_wait_idle(struct lys_net_encoder *enc) {
+  while (enc->busy) {
+    pthread_cond_wait(&enc->cond, &enc->lock);
+  }
+}
+
+static void encoder_resize(struct lys_net_encoder *enc, int width, int height) {
+  size_t n = (size_t)width * height;
+  pthread_mutex_lock(&enc->lock);
+  encoder_wait_idle(enc);
+  enc->width = width;
+  enc->height = height;
+  enc->previous = realloc(enc->previous, n * sizeof(uint32_t));
+  enc->encoded = realloc(enc->encoded, n * sizeof(uint32_t));
+  assert(enc->previous != NULL && enc->encoded != NULL);
+  enc->pending = NULL;
+  enc->keyframe_requested = true;
+  pthread_mutex_unlock(&enc->lock);
+}
+
+// The frame is not copied, and must stay valid until encoder_release().
+static void encoder_submit(struct lys_net_encoder *enc, const uint32_t *frame) {
+  pthread_mutex_lock(&enc->lock);
+  assert(enc->pending == NULL);
+  enc->pending = frame;
+  pthread_cond_signal(&enc->cond);
+  pthread_mutex_unlock(&enc->lock);
+}
+
+// Called before the submitted frame is freed or overwritten.  If the
+// encoder thread has not taken it yet, it is dropped, and otherwise we
+// wait until it has been encoded, which does not wait for the socket.
+static void encoder_release(struct lys_net_encoder *enc) {
+  pthread_mutex_lock(&enc->lock);
+  if (enc->pending != NULL) {
+    enc->pending = NULL;
+    enc->frames_dropped++;
+  }
+  while (enc->reading) {
+    pthread_cond_wait(&enc->cond, &enc->lock);
+  }
+  pthread_mutex_unlock(&enc->lock);
+}
+
+void lys_net_send_text(struct lys_context *ctx, const char *text, uint32_t colour) {
+  struct lys_net_encoder *enc = &ctx->encoder;
+  size_t len = strlen(text);
+  pthread_mutex_lock(&enc->lock);
+  enc->pending_text = realloc(enc->pending_text, len + 1);
+  assert(enc->pending_text != NULL);
+  memcpy(enc->pending_text, text, len);
+  enc->pending_text_len = len;
+  enc->pending_text_colour = colour;
+  pthread_mutex_unlock(&enc->lock);
+}
+
+static void disconnect_client(struct lys_context *ctx) {
+  struct lys_net_encoder *enc = &ctx->encoder;
+  // A viewer that stopped reading would otherwise keep the encoder
+  // blocked in send() forever.
+  shutdown(ctx->client_fd, SHUT_RDWR);
+  pthread_mutex_lock(&enc->lock);
+  encoder_wait_idle(enc);
+  enc->fd = -1;
+  enc->failed = false;
+  pthread_mutex_unlock(&enc->lock);
+  close(ctx->client_fd);
+  ctx->client_fd = -1;
+  ctx->input_len = 0;
+}
+
+static void accept_client(struct lys_context *ctx) {
+  int fd = accept(ctx->listen_fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  if (ctx->client_fd >= 0) {
+    // Only one viewer at a time; the newest one wins.
+    disconnect_client(ctx);
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ctx->client_fd = fd;
+
+  struct lys_net_encoder *enc = &ctx->encoder;
+  pthread_mutex_lock(&enc->lock);
+  enc->fd = fd;
+  enc->keyframe_requested = true;
+  pthread_mutex_unlock(&enc->lock);
+}
+
+static void window_size_updated(struct lys_context *ctx, int newx, int newy) {
+  ctx->width = newx;
+  ctx->height = newy;
+
+  struct futhark_opaque_state *new_state;
+  int64_t start = lys_wall_time();
+  FUT_CHECK(ctx->fut, futhark_entry_resize(ctx->fut, &new_state, ctx->height, ctx->width, ctx->state));
+  lys_metrics_entry(LYS_ENTRY_RESIZE, start);
+  lys_state_created();
+  lys_free_state(ctx->fut, ctx->state);
+  ctx->state = new_state;
+  ctx->job.idle = false;
+
+#ifndef LYS_HOST_FRAMES
+  ctx->data = lys_buffer_reserve(&ctx->data_buffer, ctx->width * ctx->height * sizeof(uint32_t));
+#endif
+  encoder_resize(&ctx->encoder, ctx->width, ctx->height);
+
+  trigger_event(ctx, LYS_WINDOW_SIZE_UPDATED);
+}
+
+void lys_submit_key(struct lys_context *ctx, int e, int keysym) {
+  struct lys_input input = { .kind = LYS_INPUT_KEY, .a = e, .b = keysym };
+  lys_frame_job_submit(&ctx->job, &input);
+}
+
+void lys_submit_mouse(struct lys_context *ctx, int buttons, int x, int y) {
+  struct lys_input input = { .kind = LYS_INPUT_MOUSE, .a = buttons, .b = x, .c = y };
+  lys_frame_job_submit(&ctx->job, &input);
+}
+
+void lys_submit_wheel(struct lys_context *ctx, int dx, int dy) {
+  struct lys_input input = { .kind = LYS_INPUT_WHEEL, .a = dx, .b = dy };
+  lys_frame_job_submit(&ctx->job, &input);
+}
+
+void lys_submit_resize(struct lys_context *ctx, int width, int height) {
+  if (width > 0 && height > 0 &&
+      width <= LYS_NET_MAX_SIZE && height <= LYS_NET_MAX_SIZE) {
+    lys_resize_request(&ctx->resize, width, height);
+  }
+}
+
+static void handle_net_event(struct lys_context *ctx, const struct lys_net_event *event) {
+  switch (event->type) {
+  case LYS_NET_KEY:
+    if (event->b == 0x1B) { // Escape
+      if (event->a == 0) {
+        ctx->running = 0;
+      }
+    } else if (event->b == 0x4000003A) { // F1
+      if (event->a == 0) {
+        trigger_event(ctx, LYS_F1);
+      }
+    } else if (event->b == 0x4000003B) { // F2
+      if (event->a == 0) {
+        trigger_event(ctx, LYS_F2);
+      }
+    } else {
+      lys_submit_key(ctx, event->a, event->b);
+    }
+    break;
+  case LYS_NET_MOUSE:
+    lys_submit_mouse(ctx, event->a, event->b, event->c);
+    break;
+  case LYS_NET_WHEEL:
+    lys_submit_wheel(ctx, event->a, event->b);
+    break;
+  case LYS_NET_RESIZE:
+    lys_submit_resize(ctx, event->a, event->b);
+    break;
+  }
+}
+
+static void read_client_events(struct lys_context *ctx) {
+  while (true) {
+    // The socket itself is blocking, as the encoder thread writes
+    // whole frames to it.
+    ssize_t n = recv(ctx->client_fd, ctx->input + ctx->input_len,
+                     sizeof(ctx->input) - ctx->input_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      disconnect_client(ctx);
+      return;
+    }
+    if (n < 0) {
+      return;
+    }
+    ctx->input_len += n;
+
+    size_t used = 0;
+    while (ctx->input_len - used >= sizeof(struct lys_net_event)) {
+      struct lys_net_event event;
+      memcpy(&event, ctx->input + used, sizeof(event));
+      used += sizeof(event);
+      handle_net_event(ctx, &event);
+    }
+    memmove(ctx->input, ctx->input + used, ctx->input_len - used);
+    ctx->input_len -= used;
+  }
+}
+
+// Sleep for up to 'usecs' microseconds, handling viewer connections
+// and input as soon as they arrive.  If 'until_input', return as soon
+// as anything has been handled.
+static void wait_for_events(struct lys_context *ctx, int64_t usecs, bool until_input) {
+  int64_t deadline = lys_wall_time() + usecs;
+  while (ctx->running) {
+    struct pollfd pfds[2] = {
+      { .fd = ctx->listen_fd, .events = POLLIN },
+      { .fd = ctx->client_fd, .events = POLLIN }
+    };
+    int64_t left = deadline - lys_wall_time();
+    if (left < 0) {
+      left = 0;
+    }
+    int res = poll(pfds, ctx->client_fd >= 0 ? 2 : 1, left/1000);
+    if (res > 0) {
+      if (pfds[0].revents & POLLIN) {
+        accept_client(ctx);
+      }
+      if (ctx->client_fd >= 0 && pfds[1].revents) {
+        read_client_events(ctx);
+      }
+    }
+    if (interrupted) {
+      ctx->running = 0;
+    }
+    if (left == 0 || (res < 0 && errno != EINTR) || (until_input && res > 0)) {
+      break;
+    }
+  }
+
+  if (ctx->client_fd >= 0) {
+    pthread_mutex_lock(&ctx->encoder.lock);
+    bool failed = ctx->encoder.failed;
+    pthread_mutex_unlock(&ctx->encoder.lock);
+    if (failed) {
+      disconnect_client(ctx);
+    }
+  }
+}
+
+void lys_open(struct lys_context *ctx) {
+  ctx->last_time = lys_wall_time();
+#ifndef LYS_HOST_FRAMES
+  ctx->data = lys_buffer_reserve(&ctx->data_buffer, ctx->width * ctx->height * sizeof(uint32_t));
+#endif
+  encoder_resize(&ctx->encoder, ctx->width, ctx->height);
+  assert(pthread_create(&ctx->encoder.thread, NULL, encoder_thread, &ctx->encoder) == 0);
+  lys_frame_job_init(&ctx->job, ctx->fut);
+
+  ctx->running = 1;
+
+  trigger_event(ctx, LYS_LOOP_START);
+}
+
+void lys_begin_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  // The last frame may be released or overwritten from here on.
+  encoder_release(&ctx->encoder);
+  int width, height;
+  if (lys_resize_settled(&ctx->resize, &width, &height) &&
+      (width != ctx->width || height != ctx->height)) {
+    window_size_updated(ctx, width, height);
+  }
+
+#ifdef LYS_HOT_RELOAD
+  if (lys_hot_reload(&ctx->job, &ctx->state, ctx->height, ctx->width)) {
+    trigger_event(ctx, LYS_PROGRAM_RELOADED);
+  }
+#endif
+
+  int64_t now = lys_wall_time();
+  ctx->delta = ((float)(now - ctx->last_time))/1000000.0;
+  ctx->fps = (ctx->fps*0.9 + (1/ctx->delta)*0.1);
+  ctx->last_time = now;
+}
+
+void lys_step_render_async(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  // With a CPU backend the frame is read straight from the array
+  // rendered by Futhark.
+#ifdef LYS_HOST_FRAMES
+  lys_frame_job_start(&ctx->job, ctx->state, ctx->delta, NULL);
+#else
+  lys_frame_job_start(&ctx->job, ctx->state, ctx->delta, ctx->data);
+#endif
+  ctx->state = NULL;
+  ctx->in_flight = true;
+}
+
+bool lys_frame_ready(struct lys_context *ctx) {
+  return !ctx->in_flight || lys_frame_job_done(&ctx->job);
+}
+
+void lys_await_frame(struct lys_context *ctx) {
+  if (!ctx->in_flight) {
+    return;
+  }
+  ctx->state = lys_frame_job_await(&ctx->job);
+  ctx->in_flight = false;
+}
+
+void lys_present_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  trigger_event(ctx, LYS_LOOP_ITERATION);
+
+  if (ctx->client_fd >= 0) {
+    encoder_submit(&ctx->encoder, ctx->job.frame);
+  }
+  lys_frame_job_presented(&ctx->job, &ctx->latency);
+}
+
+void lys_close(struct lys_context *ctx) {
+  struct lys_net_encoder *enc = &ctx->encoder;
+
+  lys_await_frame(ctx);
+  encoder_release(enc);
+  lys_frame_job_free(&ctx->job);
+
+  lys_free_state(ctx->fut, ctx->state);
+
+  trigger_event(ctx, LYS_LOOP_END);
+
+  if (ctx->client_fd >= 0) {
+    shutdown(ctx->client_fd, SHUT_RDWR);
+  }
+  pthread_mutex_lock(&enc->lock);
+  enc->stop = true;
+  pthread_cond_broadcast(&enc->cond);
+  pthread_mutex_unlock(&enc->lock);
+  pthread_join(enc->thread, NULL);
+
+  if (ctx->client_fd >= 0) {
+    close(ctx->client_fd);
+  }
+  close(ctx->listen_fd);
+
+  fprintf(stderr, "Sent %ld frames (%ld dropped), %.1f MiB.\n",
+          (long)enc->frames_sent, (long)enc->frames_dropped,
+          enc->bytes_sent / (1024.0*1024.0));
+
+  free(enc->previous);
+  free(enc->encoded);
+  free(enc->pending_text);
+  lys_buffer_free(&ctx->data_buffer);
+  pthread_mutex_destroy(&enc->lock);
+  pthread_cond_destroy(&enc->cond);
+}
+
+static void net_loop(struct lys_context *ctx) {
+  while (ctx->running) {
+    lys_begin_frame(ctx);
+    // When idle, the last frame is sent again without being computed
+    // (which costs little, as only changes are encoded), and we sleep
+    // until input arrives.
+    bool idle = lys_frame_job_idle(&ctx->job);
+    if (!idle) {
+      lys_step_render_async(ctx);
+      lys_await_frame(ctx);
+    }
+    lys_present_frame(ctx);
+
+    int delay =  1000.0/ctx->max_fps - ctx->delta*1000.0;
+    if (idle) {
+      delay = LYS_IDLE_TIMEOUT_MS;
+    }
+    wait_for_events(ctx, delay > 0 ? delay*1000 : 0, idle || ctx->latency_priority);
+  }
+}
+
+static void remove_socket() {
+  if (unix_socket_path != NULL) {
+    unlink(unix_socket_path);
+  }
+}
+
+static void handle_sigint(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+static int listen_socket(const char *socket_path, int port) {
+  int fd;
+  if (socket_path != NULL) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", socket_path);
+      exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+    if (!lys_remove_stale_socket(socket_path)) {
+      exit(EXIT_FAILURE);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "Cannot bind %s: %s\n", socket_path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    unix_socket_path = socket_path;
+    atexit(remove_socket);
+  } else {
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "Cannot bind port %d: %s\n", port, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  assert(listen(fd, 1) == 0);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+void lys_run_net(struct lys_context *ctx) {
+  lys_open(ctx);
+  net_loop(ctx);
+  lys_close(ctx);
+}
+
+void lys_setup(struct lys_context *ctx, int width, int height, int max_fps,
+               const char *socket_path, int port, int keyframe_interval) {
+  memset(ctx, 0, sizeof(struct lys_context));
+  ctx->width = width;
+  ctx->height = height;
+  ctx->fps = 0;
+  ctx->max_fps = max_fps;
+  ctx->client_fd = -1;
+  ctx->listen_fd = listen_socket(socket_path, port);
+
+  struct lys_net_encoder *enc = &ctx->encoder;
+  pthread_mutex_init(&enc->lock, NULL);
+  pthread_cond_init(&enc->cond, NULL);
+  enc->fd = -1;
+  enc->keyframe_interval = keyframe_interval;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigint;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
@@ -0,0 +1,117 @@
+#ifndef LIBLYS_HEADER
+#define LIBLYS_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include PROGHEADER
+
+#include "shared.h"
+#include "protocol.h"
+
+enum lys_event {
+  LYS_LOOP_START,
+  LYS_LOOP_ITERATION,
+  LYS_LOOP_END,
+  LYS_WINDOW_SIZE_UPDATED,
+  LYS_F1,
+  LYS_F2,
+  // The program was rebuilt and reloaded (LYS_HOT_RELOAD).
+  LYS_PROGRAM_RELOADED
+};
+
+// Frames are compressed and written to the viewer on a separate
+// thread, so a slow connection never stalls the frame loop.  The
+// encoder reads the frame where it was rendered, and keeps its own
+// copy only to encode the next frame against.  If the encoder is still
+// sending when the next frame starts, the pending frame is counted as
+// dropped.
+struct lys_net_encoder {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  bool stop;
+  bool busy;
+  // The encoder thread is reading the submitted frame.
+  bool reading;
+  bool failed;
+  bool keyframe_requested;
+  int keyframe_interval;
+  int width;
+  int height;
+  // The submitted frame, until the encoder thread takes it.
+  const uint32_t *pending;
+  uint32_t *previous;
+  uint32_t *encoded;
+  char *pending_text;
+  size_t pending_text_len;
+  uint32_t pending_text_colour;
+  uint32_t seq;
+  int since_keyframe;
+  int64_t frames_sent;
+  int64_t frames_dropped;
+  int64_t bytes_sent;
+};
+
+struct lys_context {
+  struct futhark_context *fut;
+  struct futhark_opaque_state *state;
+  int width;
+  int height;
+  uint32_t *data;
+  int64_t last_time;
+  bool running;
+  float fps;
+  int max_fps;
+  void* event_handler_data;
+  void (*event_handler)(struct lys_context*, enum lys_event);
+  int listen_fd;
+  int client_fd;
+  char input[sizeof(struct lys_net_event) * 64];
+  size_t input_len;
+  struct lys_net_encoder encoder;
+  float delta;
+  bool in_flight;
+  struct lys_buffer data_buffer;
+  struct lys_resize resize;
+  struct lys_frame_job job;
+  struct lys_latency latency;
+  // Set before lys_open() to start the next frame as soon as an event
+  // arrives, rather than sleeping until it is due.
+  bool latency_priority;
+};
+
+// Listen on the Unix socket 'socket_path' if non-NULL, and otherwise
+// on TCP port 'port' on the loopback interface.
+void lys_setup(struct lys_context *ctx, int width, int height, int max_fps,
+               const char *socket_path, int port, int keyframe_interval);
+
+// Runs the whole loop.  Like the other frontends, it is built from
+// the frame API below; see sdl/liblys.h for how the calls fit together.
+void lys_run_net(struct lys_context *ctx);
+
+void lys_open(struct lys_context *ctx);
+void lys_begin_frame(struct lys_context *ctx);
+void lys_submit_key(struct lys_context *ctx, int e, int keysym);
+void lys_submit_mouse(struct lys_context *ctx, int buttons, int x, int y);
+void lys_submit_wheel(struct lys_context *ctx, int dx, int dy);
+// Sizes that are not positive, or are above LYS_NET_MAX_SIZE, are
+// ignored.
+void lys_submit_resize(struct lys_context *ctx, int width, int height);
+void lys_step_render_async(struct lys_context *ctx);
+bool lys_frame_ready(struct lys_context *ctx);
+void lys_await_frame(struct lys_context *ctx);
+
+// Hand the frame to the encoder thread.
+void lys_present_frame(struct lys_context *ctx);
+
+void lys_close(struct lys_context *ctx);
+
+// Send the text overlay along with the next frame.
+void lys_net_send_text(struct lys_context *ctx, const char *text, uint32_t colour);
+
+#endif
@@ -0,0 +1,345 @@
+#include "liblys.h"
+#include PRINTFHEADER
+#include "metrics.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+
+#define INITIAL_WIDTH 800
+#define INITIAL_HEIGHT 600
+#define DEFAULT_PORT 7300
+
+bool show_text = true;
+
+// Live kernel profiling (-P), and the statistics overlay toggled with
+// F2.
+const char *profile_output = NULL;
+struct lys_profile profile;
+bool show_stats = false;
+char *stats_buffer = NULL;
+size_t stats_buffer_len = 0;
+
+// Thread placement (-a, -A), and frame jitter for the overlay and -B.
+const char *frontend_cpus = NULL;
+const char *worker_cpus = NULL;
+
+// Start frames as soon as input arrives (-L).
+bool latency_priority = false;
+
+// Memory use, and the budget (-M) beyond which we stop.
+struct lys_memory memory;
+int64_t memory_budget = 0;
+bool memory_exceeded = false;
+
+// Counters served for monitoring (-m).
+const char *metrics_address = NULL;
+struct lys_metrics_server *metrics_server = NULL;
+struct lys_frame_stats frame_stats;
+
+void loop_start(struct lys_context *ctx, struct lys_text *text) {
+  prepare_text(ctx->fut, text);
+  text->show_text = show_text;
+  stats_buffer_len = text->text_buffer_len + LYS_STATS_BUFFER_SIZE;
+  stats_buffer = malloc(stats_buffer_len);
+  assert(stats_buffer != NULL);
+}
+
+void loop_iteration(struct lys_context *ctx, struct lys_text *text) {
+  lys_frame_stats_frame(&frame_stats);
+  lys_metrics_frame(ctx->job.idle);
+  if (profile_output != NULL) {
+    lys_profile_frame(&profile, ctx->fut);
+  }
+  if ((memory_budget > 0 || show_stats || metrics_server != NULL) &&
+      !lys_memory_frame(&memory, ctx->fut, profile_output != NULL ? &profile : NULL)) {
+    memory_exceeded = true;
+    ctx->running = 0;
+  }
+  if (!text->show_text && !show_stats) {
+#ifdef LYS_DEVICE_TEXT
+    lys_frame_job_set_text(&ctx->job, "", 0, ctx->height, ctx->width);
+#else
+    lys_net_send_text(ctx, "", 0);
+#endif
+    return;
+  }
+
+  char *overlay = text->text_buffer;
+  if (text->show_text) {
+    build_text(ctx, text->text_buffer, text->text_buffer_len, text->text_format,
+               ctx->fps, text->sum_names);
+  } else {
+    text->text_buffer[0] = '\0';
+  }
+  if (show_stats) {
+    lys_build_stats(stats_buffer, stats_buffer_len, text->text_buffer,
+                    &frame_stats, &ctx->latency, &memory,
+                    profile_output != NULL ? &profile : NULL);
+    overlay = stats_buffer;
+  }
+  int32_t text_colour;
+  FUT_CHECK(ctx->fut,
+            futhark_entry_text_colour(ctx->fut, (uint32_t*) &text_colour,
+                                      ctx->state));
+#ifdef LYS_DEVICE_TEXT
+  // Composited into the following frames by the Futhark program.
+  lys_frame_job_set_text(&ctx->job, overlay, text_colour, ctx->height, ctx->width);
+#else
+  lys_net_send_text(ctx, overlay, text_colour);
+#endif
+}
+
+void loop_end(struct lys_text *text) {
+  free(text->text_format);
+  free(text->text_buffer);
+  free(stats_buffer);
+
+  for (size_t i = 0; i < n_printf_arguments(); i++) {
+    if (text->sum_names[i] != NULL) {
+      size_t j = 0;
+      while (text->sum_names[i][j] != NULL) {
+        free(text->sum_names[i][j]);
+        j++;
+      }
+      free(text->sum_names[i]);
+    }
+  }
+  free(text->sum_names);
+}
+
+void f1(struct lys_text *text) {
+  text->show_text = !text->show_text;
+}
+
+void f2(void) {
+  show_stats = !show_stats;
+}
+
+// The text format may have changed, so prepare it again.
+void program_reloaded(struct lys_context *ctx, struct lys_text *text) {
+  bool show = text->show_text;
+  loop_end(text);
+  loop_start(ctx, text);
+  text->show_text = show;
+}
+
+void handle_event(struct lys_context *ctx, enum lys_event event) {
+  struct lys_text *text = (struct lys_text *) ctx->event_handler_data;
+  switch (event) {
+  case LYS_LOOP_START:
+    loop_start(ctx, text);
+    break;
+  case LYS_LOOP_ITERATION:
+    loop_iteration(ctx, text);
+    break;
+  case LYS_LOOP_END:
+    loop_end(text);
+    break;
+  case LYS_WINDOW_SIZE_UPDATED:
+    break;
+  case LYS_F1:
+    f1(text);
+    break;
+  case LYS_F2:
+    f2();
+    break;
+  case LYS_PROGRAM_RELOADED:
+    program_reloaded(ctx, text);
+  }
+}
+
+void usage(char **argv) {
+  printf("Usage: %s options...\n", argv[0]);
+  puts("Options:");
+  puts("  -?       Print this help and exit.");
+  puts("  -w INT   Set the initial width of the frame.");
+  puts("  -h INT   Set the initial height of the frame.");
+  puts("  -R       Does nothing.");
+  puts("  -d DEV   Set the computation device.");
+  puts("  -r INT   Maximum frames per second.");
+  puts("  -t       Do not show text by default.");
+  puts("  -i       Select execution device interactively.");
+  printf("  -p PORT  Listen on this TCP port on localhost (default %d).\n", DEFAULT_PORT);
+  puts("  -u PATH  Listen on this Unix socket instead of TCP.");
+  puts("  -K INT   Send a keyframe at least this often (in frames).");
+  puts("  -P FILE  Profile kernels, and write a report to FILE.");
+  puts("  -a CPUS  Run the frontend on these CPUs, such as 0-3,8.");
+  puts("  -A CPUS  Run the Futhark code on these CPUs.");
+  puts("  -L       Start frames as soon as input arrives, for lower latency.");
+  puts("  -M MIB   Stop if Futhark and frame buffers use more memory.");
+  puts("  -m ADDR  Serve metrics on this localhost port, or unix:PATH.");
+}
+
+int main(int argc, char** argv) {
+  int width = INITIAL_WIDTH, height = INITIAL_HEIGHT, max_fps = 60;
+  char *deviceopt = NULL;
+  bool device_interactive = false;
+  char *socket_path = NULL;
+  int port = DEFAULT_PORT;
+  int keyframe_interval = 60;
+
+  int c;
+  while ( (c = getopt(argc, argv, "w:h:r:Rtd:ip:u:K:P:a:A:LM:m:")) != -1) {
+    switch (c) {
+    case 'w':
+      width = atoi(optarg);
+      if (width <= 0) {
+        fprintf(stderr, "'%s' is not a valid width.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      height = atoi(optarg);
+      if (height <= 0) {
+        fprintf(stderr, "'%s' is not a valid height.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      max_fps = atoi(optarg);
+      if (max_fps <= 0) {
+        fprintf(stderr, "'%s' is not a valid framerate.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'R':
+      // This is for compatibility with the SDL frontend.
+      break;
+    case 't':
+      show_text = false;
+      break;
+    case 'd':
+      deviceopt = optarg;
+      break;
+    case 'i':
+      device_interactive = true;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535) {
+        fprintf(stderr, "'%s' is not a valid port.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'u':
+      socket_path = optarg;
+      break;
+    case 'K':
+      keyframe_interval = atoi(optarg);
+      if (keyframe_interval <= 0) {
+        fprintf(stderr, "'%s' is not a valid keyframe interval.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'P':
+      profile_output = optarg;
+      break;
+    case 'a':
+      frontend_cpus = optarg;
+      break;
+    case 'A':
+      worker_cpus = optarg;
+      break;
+    case 'L':
+      latency_priority = true;
+      break;
+    case 'm':
+      metrics_address = optarg;
+      break;
+    case 'M':
+      memory_budget = atoll(optarg) * 1024 * 1024;
+      if (memory_budget <= 0) {
+        fprintf(stderr, "'%s' is not a valid number of MiB.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case '?':
+      usage(argv);
+      return EXIT_SUCCESS;
+    default:
+      fprintf(stderr, "unknown option: %c\n", c);
+      usage(argv);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    fprintf(stderr, "Excess non-options: ");
+    while (optind < argc)
+      fprintf(stderr, "%s ", argv[optind++]);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Before anything is allocated, so that it is first touched on the
+  // frontend's NUMA node.
+  if (!lys_set_placement(frontend_cpus, worker_cpus)) {
+    exit(EXIT_FAILURE);
+  }
+
+  lys_metrics_init(max_fps);
+  if (metrics_address != NULL) {
+    metrics_server = lys_metrics_serve(metrics_address);
+    if (metrics_server == NULL) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct lys_context ctx;
+  struct futhark_context_config *futcfg;
+  lys_setup(&ctx, width, height, max_fps, socket_path, port, keyframe_interval);
+  ctx.latency_priority = latency_priority;
+
+  char* opencl_device_name = NULL;
+  lys_setup_futhark_context(argv[0],
+                            deviceopt, device_interactive,
+                            profile_output != NULL,
+                            &futcfg, &ctx.fut, &opencl_device_name);
+  if (opencl_device_name != NULL) {
+    printf("Using OpenCL device: %s\n", opencl_device_name);
+    printf("Use -d or -i to change this.\n");
+    free(opencl_device_name);
+  }
+
+  if (socket_path != NULL) {
+    printf("Serving frames on %s\n", socket_path);
+  } else {
+    printf("Serving frames on 127.0.0.1:%d\n", port);
+  }
+  fflush(stdout);
+
+  struct lys_text text;
+  ctx.event_handler_data = (void*) &text;
+  ctx.event_handler = handle_event;
+
+  int32_t seed = (int32_t) lys_wall_time();
+  futhark_entry_init(ctx.fut, &ctx.state, seed, ctx.height, ctx.width);
+  lys_state_created();
+  lys_profile_init(&profile);
+  lys_frame_stats_init(&frame_stats);
+  lys_memory_init(&memory, memory_budget);
+  lys_run_net(&ctx);
+
+  if (profile_output != NULL &&
+      lys_profile_write(&profile, ctx.fut, profile_output) != 0) {
+    return EXIT_FAILURE;
+  }
+  lys_profile_free(&profile);
+
+  if (ctx.latency.num_samples > 0) {
+    fprintf(stderr, "Input-to-display latency over the last %d frames with input: p50 %.1fms, p99 %.1fms\n",
+            ctx.latency.num_samples,
+            lys_latency_percentile(&ctx.latency, 50)/1000.0,
+            lys_latency_percentile(&ctx.latency, 99)/1000.0);
+  }
+
+  if (metrics_server != NULL) {
+    lys_metrics_server_free(metrics_server);
+  }
+
+  futhark_context_free(ctx.fut);
+  futhark_context_config_free(futcfg);
+
+  return memory_exceeded ? EXIT_FAILURE : EXIT_SUCCESS;
+}
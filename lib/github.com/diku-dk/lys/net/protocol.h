@@ -0,0 +1,58 @@
+// Wire protocol between the network frontend and its viewers.
+//
+// The server sends a stream of messages, each a 'struct lys_net_header'
+// followed by 'size' bytes of payload.  The viewer sends fixed-size
+// 'struct lys_net_event' records.  All integers are in the byte order
+// of the machine running the server; the viewer is expected to run on
+// a machine of the same kind.
+
+#ifndef LIBLYS_NET_PROTOCOL
+#define LIBLYS_NET_PROTOCOL
+
+#include <stdint.h>
+
+enum lys_net_message {
+  // Payload is width*height raw ARGB pixels.
+  LYS_NET_KEYFRAME = 1,
+  // Payload is the XOR of this frame and the previous one, as a
+  // sequence of runs: a uint32_t count of unchanged pixels to skip, a
+  // uint32_t count of changed pixels, and then that many uint32_t
+  // values to XOR into the previous frame.
+  LYS_NET_DELTA = 2,
+  // Payload is a uint32_t ARGB colour followed by the text overlay in
+  // UTF-8 (not NUL-terminated).  An empty text means no overlay.
+  LYS_NET_TEXT = 3
+};
+
+struct lys_net_header {
+  uint32_t type;
+  uint32_t size;
+  uint32_t seq;
+  uint32_t width;
+  uint32_t height;
+};
+
+enum lys_net_input {
+  // a: 0 for keydown, 1 for keyup.  b: SDL keycode.
+  LYS_NET_KEY = 1,
+  // a: button mask.  b, c: x, y.
+  LYS_NET_MOUSE = 2,
+  // a, b: dx, dy.
+  LYS_NET_WHEEL = 3,
+  // a, b: width, height, each at most LYS_NET_MAX_SIZE.
+  LYS_NET_RESIZE = 4
+};
+
+// The largest width or height a viewer may ask for.  This keeps the
+// frame buffers bounded, and the payload of a frame well within the
+// 'size' of a header.
+#define LYS_NET_MAX_SIZE 8192
+
+struct lys_net_event {
+  int32_t type;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+};
+
+#endif
@@ -0,0 +1,237 @@
+// Reference viewer for the network frontend.  It decodes the frame
+// stream, can send a few input events, and writes the last frame it
+// received as a PPM image.  It is mostly useful for testing a Lys
+// program served with LYS_FRONTEND=net entirely on localhost.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define DEFAULT_PORT 7300
+
+static bool read_all(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t res = read(fd, p, n);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+    p += res;
+    n -= res;
+  }
+  return true;
+}
+
+static void send_event(int fd, int32_t type, int32_t a, int32_t b, int32_t c) {
+  struct lys_net_event event = { .type = type, .a = a, .b = b, .c = c };
+  if (write(fd, &event, sizeof(event)) != sizeof(event)) {
+    fprintf(stderr, "Cannot send event: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int connect_socket(const char *socket_path, int port) {
+  int fd;
+  int res;
+  if (socket_path != NULL) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    res = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  } else {
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    res = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  }
+  if (fd < 0 || res != 0) {
+    fprintf(stderr, "Cannot connect: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+static void write_ppm(const char *path, const uint32_t *frame, int width, int height) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int i = 0; i < width * height; i++) {
+    fputc((frame[i]>>16)&0xFF, f);
+    fputc((frame[i]>>8)&0xFF, f);
+    fputc((frame[i]>>0)&0xFF, f);
+  }
+  fclose(f);
+}
+
+static void usage(char **argv) {
+  printf("Usage: %s options...\n", argv[0]);
+  puts("Options:");
+  puts("  -?          Print this help and exit.");
+  printf("  -p PORT     Connect to this TCP port on localhost (default %d).\n", DEFAULT_PORT);
+  puts("  -u PATH     Connect to this Unix socket instead of TCP.");
+  puts("  -f INT      Number of frames to receive (default 60).");
+  puts("  -s WxH      Ask the server for this frame size.");
+  puts("  -k KEYS     Press and release these keys after the first frame.");
+  puts("  -o FILE     Write the last frame to FILE as PPM.");
+}
+
+int main(int argc, char** argv) {
+  char *socket_path = NULL;
+  int port = DEFAULT_PORT;
+  int num_frames = 60;
+  int req_width = 0, req_height = 0;
+  const char *keys = NULL;
+  const char *output = NULL;
+
+  int c;
+  while ( (c = getopt(argc, argv, "p:u:f:s:k:o:")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'u':
+      socket_path = optarg;
+      break;
+    case 'f':
+      num_frames = atoi(optarg);
+      break;
+    case 's':
+      if (sscanf(optarg, "%dx%d", &req_width, &req_height) != 2 ||
+          req_width <= 0 || req_height <= 0 ||
+          req_width > LYS_NET_MAX_SIZE || req_height > LYS_NET_MAX_SIZE) {
+        fprintf(stderr, "'%s' is not a valid size.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'k':
+      keys = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case '?':
+    default:
+      usage(argv);
+      return c == '?' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  int fd = connect_socket(socket_path, port);
+
+  if (req_width > 0) {
+    send_event(fd, LYS_NET_RESIZE, req_width, req_height, 0);
+  }
+
+  uint32_t *frame = NULL, *payload = NULL;
+  size_t frame_capacity = 0, payload_capacity = 0;
+  int width = 0, height = 0;
+  int keyframes = 0, deltas = 0;
+  size_t bytes = 0;
+  char *text = NULL;
+
+  while (keyframes + deltas < num_frames) {
+    struct lys_net_header header;
+    if (!read_all(fd, &header, sizeof(header))) {
+      fprintf(stderr, "Connection closed.\n");
+      break;
+    }
+    if (header.size > payload_capacity) {
+      payload_capacity = header.size;
+      payload = realloc(payload, payload_capacity);
+    }
+    if (!read_all(fd, payload, header.size)) {
+      fprintf(stderr, "Connection closed.\n");
+      break;
+    }
+    bytes += sizeof(header) + header.size;
+
+    size_t n = (size_t)header.width * header.height;
+    switch (header.type) {
+    case LYS_NET_KEYFRAME:
+      if (header.size != n * sizeof(uint32_t)) {
+        fprintf(stderr, "Keyframe of %u bytes for a %ux%u frame.\n",
+                header.size, header.width, header.height);
+        exit(EXIT_FAILURE);
+      }
+      if (n > frame_capacity) {
+        frame_capacity = n;
+        frame = realloc(frame, n * sizeof(uint32_t));
+      }
+      width = header.width;
+      height = header.height;
+      memcpy(frame, payload, n * sizeof(uint32_t));
+      keyframes++;
+      break;
+    case LYS_NET_DELTA:
+      {
+        if ((int)header.width != width || (int)header.height != height) {
+          fprintf(stderr, "Delta for a %dx%d frame without a keyframe.\n",
+                  header.width, header.height);
+          exit(EXIT_FAILURE);
+        }
+        size_t words = header.size / sizeof(uint32_t);
+        size_t i = 0, pos = 0;
+        while (i + 2 <= words) {
+          pos += payload[i++];
+          uint32_t count = payload[i++];
+          for (uint32_t j = 0; j < count && pos < n && i < words; j++) {
+            frame[pos++] ^= payload[i++];
+          }
+        }
+        deltas++;
+      }
+      break;
+    case LYS_NET_TEXT:
+      if (header.size < sizeof(uint32_t)) {
+        fprintf(stderr, "Text message of %u bytes.\n", header.size);
+        exit(EXIT_FAILURE);
+      }
+      free(text);
+      text = strndup((char*)payload + sizeof(uint32_t), header.size - sizeof(uint32_t));
+      break;
+    }
+
+    if (keys != NULL && keyframes + deltas > 0) {
+      for (const char *k = keys; *k; k++) {
+        send_event(fd, LYS_NET_KEY, 0, *k, 0);
+        send_event(fd, LYS_NET_KEY, 1, *k, 0);
+      }
+      keys = NULL;
+    }
+  }
+
+  size_t raw_bytes = (size_t)(keyframes + deltas) * width * height * sizeof(uint32_t);
+  printf("Received %d keyframes and %d deltas of %dx%d, %zu bytes (%.1f%% of raw).\n",
+         keyframes, deltas, width, height, bytes,
+         raw_bytes > 0 ? 100.0 * bytes / raw_bytes : 0.0);
+  if (text != NULL && *text != '\0') {
+    printf("Text overlay:\n%s\n", text);
+  }
+
+  if (output != NULL && frame != NULL) {
+    write_ppm(output, frame, width, height);
+  }
+
+  close(fd);
+  free(frame);
+  free(payload);
+  free(text);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,584 @@
+// Renders one image of a program at a size far beyond what fits in
+// device or host memory, such as a print of a fractal, as a directory
+// of tiles.  Each tile is rendered by the entry point in gentile.fut
+// from the same state, so only a few tiles are in memory at once, and
+// the next tile is computed while the last one is written.
+//
+// With -j, the tiles are instead rendered by that many worker
+// processes, each of which computes the same state from the seed and
+// is handed one tile at a time over a socket; see render_farm().
+
+#include "shared.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+// How many times a tile is handed out before a farm gives up on it.
+// A farm also starts at most this many new workers per worker.
+#define LYS_POSTER_ATTEMPTS 3
+
+// Tiles that have been read back but not yet written.  Two is enough
+// for rendering to overlap with writing.
+#define LYS_POSTER_BUFFERS 2
+
+struct tile {
+  uint32_t *pixels;
+  int row, col;
+  int height, width;
+  bool full;
+};
+
+// Writes the tiles on a thread of its own, in the order they are
+// filled.
+struct writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct tile tiles[LYS_POSTER_BUFFERS];
+  bool stop;
+  const char *dir;
+  unsigned char *row;
+};
+
+// What to render, from the command line.
+struct poster {
+  int width, height, tile_size;
+  int rows, cols;
+  uint32_t seed;
+  int num_steps, max_fps;
+  const char *progname;
+  char *deviceopt;
+  bool device_interactive;
+  const char *output_dir;
+};
+
+void usage(char **argv) {
+  printf("Usage: %s options...\n", argv[0]);
+  puts("Options:");
+  puts("  -?       Print this help and exit.");
+  puts("  -w INT   Image width.");
+  puts("  -h INT   Image height.");
+  puts("  -t INT   Width and height of the tiles.");
+  puts("  -s INT   Seed of the state.");
+  puts("  -f INT   Steps taken before rendering.");
+  puts("  -r INT   Steps per second of simulated time.");
+  puts("  -o DIR   Write the tiles and DIR/index.json to DIR.");
+  puts("  -d DEV   Set the computation device.");
+  puts("  -i       Select execution device interactively.");
+  puts("  -j INT   Render in this many worker processes.");
+}
+
+static void write_tile(const char *dir, const struct tile *tile, unsigned char *row) {
+  int bufsize = strlen(dir) + 32;
+  char buf[bufsize];
+  snprintf(buf, bufsize, "%s/%d_%d.ppm", dir, tile->row, tile->col);
+  FILE *f = fopen(buf, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", buf, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "P6\n%d %d\n255\n", tile->width, tile->height);
+  for (int y = 0; y < tile->height; y++) {
+    for (int x = 0; x < tile->width; x++) {
+      uint32_t p = tile->pixels[y*tile->width+x];
+      row[x*3+0] = (p >> 16) & 0xFF;
+      row[x*3+1] = (p >> 8) & 0xFF;
+      row[x*3+2] = p & 0xFF;
+    }
+    fwrite(row, 3, tile->width, f);
+  }
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", buf, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void* writer_thread(void *arg) {
+  struct writer *w = arg;
+  int next = 0;
+  pthread_mutex_lock(&w->lock);
+  while (true) {
+    while (!w->stop && !w->tiles[next].full) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (!w->tiles[next].full) {
+      break;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    write_tile(w->dir, &w->tiles[next], w->row);
+
+    pthread_mutex_lock(&w->lock);
+    w->tiles[next].full = false;
+    pthread_cond_broadcast(&w->cond);
+    next = (next + 1) % LYS_POSTER_BUFFERS;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+static void write_index(const char *dir, int height, int width, int tile_size,
+                        int rows, int cols) {
+  int bufsize = strlen(dir) + 32;
+  char buf[bufsize];
+  snprintf(buf, bufsize, "%s/index.json", dir);
+  FILE *f = fopen(buf, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", buf, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "{\n");
+  fprintf(f, "  \"height\": %d,\n", height);
+  fprintf(f, "  \"width\": %d,\n", width);
+  fprintf(f, "  \"tile_size\": %d,\n", tile_size);
+  fprintf(f, "  \"rows\": %d,\n", rows);
+  fprintf(f, "  \"columns\": %d,\n", cols);
+  fprintf(f, "  \"tiles\": \"{row}_{column}.ppm\"\n");
+  fprintf(f, "}\n");
+  fclose(f);
+}
+
+static void tile_rect(const struct poster *p, int i, struct tile *tile) {
+  tile->row = i / p->cols;
+  tile->col = i % p->cols;
+  int y = tile->row * p->tile_size, x = tile->col * p->tile_size;
+  tile->height = p->height - y < p->tile_size ? p->height - y : p->tile_size;
+  tile->width = p->width - x < p->tile_size ? p->width - x : p->tile_size;
+}
+
+// Creates the context and computes the state that every tile is
+// rendered from.
+static struct futhark_opaque_state* poster_state(const struct poster *p,
+                                                 struct futhark_context_config **futcfg,
+                                                 struct futhark_context **fut) {
+  char* opencl_device_name = NULL;
+  lys_setup_futhark_context(p->progname,
+                            p->deviceopt, p->device_interactive, false,
+                            futcfg, fut, &opencl_device_name);
+  if (opencl_device_name != NULL) {
+    printf("Using OpenCL device: %s\n", opencl_device_name);
+    free(opencl_device_name);
+  }
+
+  struct futhark_opaque_state *state;
+  FUT_CHECK(*fut, futhark_entry_init(*fut, &state, p->seed, p->height, p->width));
+  for (int i = 0; i < p->num_steps; i++) {
+    struct futhark_opaque_state *new_state;
+    FUT_CHECK(*fut, futhark_entry_step(*fut, &new_state, 1.0/p->max_fps, state));
+    FUT_CHECK(*fut, futhark_free_opaque_state(*fut, state));
+    state = new_state;
+  }
+  return state;
+}
+
+static void render_local(const struct poster *p) {
+  struct futhark_context_config *futcfg;
+  struct futhark_context *fut;
+  struct futhark_opaque_state *state = poster_state(p, &futcfg, &fut);
+
+  struct writer w;
+  memset(&w, 0, sizeof(struct writer));
+  w.dir = p->output_dir;
+  w.row = malloc((size_t)p->tile_size * 3);
+  assert(w.row != NULL);
+  for (int i = 0; i < LYS_POSTER_BUFFERS; i++) {
+    w.tiles[i].pixels = malloc((size_t)p->tile_size * p->tile_size * sizeof(uint32_t));
+    assert(w.tiles[i].pixels != NULL);
+  }
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  assert(pthread_create(&w.thread, NULL, writer_thread, &w) == 0);
+
+  for (int i = 0; i < p->rows * p->cols; i++) {
+    struct tile *tile = &w.tiles[i % LYS_POSTER_BUFFERS];
+    struct tile rect;
+    tile_rect(p, i, &rect);
+
+    struct futhark_u32_2d *out_arr;
+    FUT_CHECK(fut, futhark_entry_render_tile(fut, &out_arr,
+                                             rect.row * p->tile_size,
+                                             rect.col * p->tile_size,
+                                             rect.height, rect.width, state));
+
+    // Wait for the writer to be done with the buffer only now, so that
+    // the tile is rendered while the previous one is written.
+    pthread_mutex_lock(&w.lock);
+    while (tile->full) {
+      pthread_cond_wait(&w.cond, &w.lock);
+    }
+    pthread_mutex_unlock(&w.lock);
+
+    FUT_CHECK(fut, futhark_values_u32_2d(fut, out_arr, tile->pixels));
+    FUT_CHECK(fut, futhark_context_sync(fut));
+    FUT_CHECK(fut, futhark_free_u32_2d(fut, out_arr));
+
+    pthread_mutex_lock(&w.lock);
+    tile->row = rect.row;
+    tile->col = rect.col;
+    tile->height = rect.height;
+    tile->width = rect.width;
+    tile->full = true;
+    pthread_cond_broadcast(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+  }
+
+  pthread_mutex_lock(&w.lock);
+  w.stop = true;
+  pthread_cond_broadcast(&w.cond);
+  pthread_mutex_unlock(&w.lock);
+  pthread_join(w.thread, NULL);
+
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+  for (int i = 0; i < LYS_POSTER_BUFFERS; i++) {
+    free(w.tiles[i].pixels);
+  }
+  free(w.row);
+
+  FUT_CHECK(fut, futhark_free_opaque_state(fut, state));
+  futhark_context_free(fut);
+  futhark_context_config_free(futcfg);
+}
+
+static bool read_all(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t res = read(fd, p, n);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+    p += res;
+    n -= res;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t res = send(fd, p, n, MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+    p += res;
+    n -= res;
+  }
+  return true;
+}
+
+// A worker reads tile numbers from 'fd', and answers each with the
+// tile's number followed by its pixels.  It exits when the socket is
+// closed.
+static void worker_main(const struct poster *p, int fd) {
+  struct futhark_context_config *futcfg;
+  struct futhark_context *fut;
+  struct futhark_opaque_state *state = poster_state(p, &futcfg, &fut);
+  uint32_t *pixels = malloc((size_t)p->tile_size * p->tile_size * sizeof(uint32_t));
+  assert(pixels != NULL);
+
+  int32_t i;
+  while (read_all(fd, &i, sizeof(i))) {
+    struct tile rect;
+    tile_rect(p, i, &rect);
+    struct futhark_u32_2d *out_arr;
+    FUT_CHECK(fut, futhark_entry_render_tile(fut, &out_arr,
+                                             rect.row * p->tile_size,
+                                             rect.col * p->tile_size,
+                                             rect.height, rect.width, state));
+    FUT_CHECK(fut, futhark_values_u32_2d(fut, out_arr, pixels));
+    FUT_CHECK(fut, futhark_context_sync(fut));
+    FUT_CHECK(fut, futhark_free_u32_2d(fut, out_arr));
+    if (!write_all(fd, &i, sizeof(i)) ||
+        !write_all(fd, pixels, (size_t)rect.height * rect.width * sizeof(uint32_t))) {
+      break;
+    }
+  }
+
+  free(pixels);
+  FUT_CHECK(fut, futhark_free_opaque_state(fut, state));
+  futhark_context_free(fut);
+  futhark_context_config_free(futcfg);
+}
+
+struct worker {
+  pid_t pid;
+  int fd;     // -1 if the worker is gone.
+  int tile;   // The tile it is rendering, or -1.
+};
+
+static void start_worker(const struct poster *p, struct worker *workers, int num_workers,
+                         struct worker *w) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot start worker: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    for (int j = 0; j < num_workers; j++) {
+      if (workers[j].fd >= 0) {
+        close(workers[j].fd);
+      }
+    }
+    worker_main(p, fds[1]);
+    _exit(EXIT_SUCCESS);
+  }
+  close(fds[1]);
+  w->pid = pid;
+  w->fd = fds[0];
+  w->tile = -1;
+}
+
+static void stop_worker(struct worker *w) {
+  close(w->fd);
+  waitpid(w->pid, NULL, 0);
+  w->fd = -1;
+}
+
+// Renders the tiles in 'num_workers' processes.  The coordinating
+// process never creates a Futhark context, so it can fork safely.
+// Tiles are handed out one at a time to whichever worker is done, so
+// fast workers take more of them, and the coordinator writes them as
+// they arrive.  If a worker dies, its tile is handed out again and a
+// new worker takes its place, up to a limit.
+static void render_farm(const struct poster *p, int num_workers) {
+  int num_tiles = p->rows * p->cols;
+  int *pending = malloc(num_tiles * sizeof(int));
+  int *attempts = calloc(num_tiles, sizeof(int));
+  struct worker *workers = malloc(num_workers * sizeof(struct worker));
+  struct pollfd *pfds = malloc(num_workers * sizeof(struct pollfd));
+  assert(pending != NULL && attempts != NULL && workers != NULL && pfds != NULL);
+  // A stack, so the tiles go out in order, and retries go out first.
+  int num_pending = num_tiles;
+  for (int i = 0; i < num_tiles; i++) {
+    pending[i] = num_tiles - 1 - i;
+  }
+
+  for (int j = 0; j < num_workers; j++) {
+    workers[j].fd = -1;
+  }
+  for (int j = 0; j < num_workers; j++) {
+    start_worker(p, workers, num_workers, &workers[j]);
+  }
+
+  struct tile tile;
+  tile.pixels = malloc((size_t)p->tile_size * p->tile_size * sizeof(uint32_t));
+  unsigned char *row = malloc((size_t)p->tile_size * 3);
+  assert(tile.pixels != NULL && row != NULL);
+
+  int done = 0, restarts = 0;
+  while (done < num_tiles) {
+    int alive = 0;
+    for (int j = 0; j < num_workers; j++) {
+      struct worker *w = &workers[j];
+      if (w->fd >= 0 && w->tile < 0 && num_pending > 0) {
+        w->tile = pending[--num_pending];
+        attempts[w->tile]++;
+        int32_t i = w->tile;
+        // A failed send shows up as a dead worker below.
+        write_all(w->fd, &i, sizeof(i));
+      }
+      pfds[j].fd = w->fd;
+      pfds[j].events = POLLIN;
+      alive += w->fd >= 0;
+    }
+    if (alive == 0) {
+      fprintf(stderr, "All workers died with %d tiles left.\n", num_tiles - done);
+      exit(EXIT_FAILURE);
+    }
+    if (poll(pfds, num_workers, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Cannot wait for workers: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    for (int j = 0; j < num_workers; j++) {
+      struct worker *w = &workers[j];
+      if (w->fd < 0 || pfds[j].revents == 0) {
+        continue;
+      }
+      int32_t i;
+      if (w->tile >= 0) {
+        tile_rect(p, w->tile, &tile);
+      }
+      if (w->tile >= 0 && read_all(w->fd, &i, sizeof(i)) && i == w->tile &&
+          read_all(w->fd, tile.pixels, (size_t)tile.height * tile.width * sizeof(uint32_t))) {
+        write_tile(p->output_dir, &tile, row);
+        w->tile = -1;
+        done++;
+        continue;
+      }
+
+      // The worker has died, or is not making sense.
+      stop_worker(w);
+      if (w->tile >= 0) {
+        if (attempts[w->tile] >= LYS_POSTER_ATTEMPTS) {
+          fprintf(stderr, "Tile %d failed %d times; giving up.\n",
+                  w->tile, attempts[w->tile]);
+          exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Worker %d died rendering tile %d; retrying.\n", (int)w->pid, w->tile);
+        pending[num_pending++] = w->tile;
+      } else {
+        fprintf(stderr, "Worker %d died while idle.\n", (int)w->pid);
+      }
+      if (restarts < num_workers * LYS_POSTER_ATTEMPTS) {
+        restarts++;
+        start_worker(p, workers, num_workers, w);
+      }
+    }
+  }
+
+  for (int j = 0; j < num_workers; j++) {
+    if (workers[j].fd >= 0) {
+      stop_worker(&workers[j]);
+    }
+  }
+  free(tile.pixels);
+  free(row);
+  free(pfds);
+  free(workers);
+  free(attempts);
+  free(pending);
+}
+
+int main(int argc, char** argv) {
+  struct poster p = {
+    .width = 8192, .height = 8192, .tile_size = 1024,
+    .seed = 0, .num_steps = 0, .max_fps = 60,
+    .progname = argv[0],
+    .deviceopt = NULL, .device_interactive = false,
+    .output_dir = "poster"
+  };
+  int num_workers = 0;
+  long long seed_arg;
+  char *seed_end;
+
+  int c;
+  while ( (c = getopt(argc, argv, "w:h:t:s:f:r:o:d:ij:")) != -1) {
+    switch (c) {
+    case 'w':
+      p.width = atoi(optarg);
+      if (p.width <= 0) {
+        fprintf(stderr, "'%s' is not a valid width.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      p.height = atoi(optarg);
+      if (p.height <= 0) {
+        fprintf(stderr, "'%s' is not a valid height.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      p.tile_size = atoi(optarg);
+      if (p.tile_size <= 0) {
+        fprintf(stderr, "'%s' is not a valid tile size.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      seed_arg = strtoll(optarg, &seed_end, 10);
+      if (*optarg == '\0' || *seed_end != '\0' ||
+          seed_arg < INT32_MIN || seed_arg > UINT32_MAX) {
+        fprintf(stderr, "'%s' is not a valid seed.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      p.seed = (uint32_t)seed_arg;
+      break;
+    case 'f':
+      p.num_steps = atoi(optarg);
+      if (p.num_steps < 0) {
+        fprintf(stderr, "'%s' is not a number of steps.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      p.max_fps = atoi(optarg);
+      if (p.max_fps <= 0) {
+        fprintf(stderr, "'%s' is not a valid framerate.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'o':
+      p.output_dir = optarg;
+      break;
+    case 'd':
+      p.deviceopt = optarg;
+      break;
+    case 'i':
+      p.device_interactive = true;
+      break;
+    case 'j':
+      num_workers = atoi(optarg);
+      if (num_workers <= 0) {
+        fprintf(stderr, "'%s' is not a number of workers.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case '?':
+      usage(argv);
+      return EXIT_SUCCESS;
+    default:
+      fprintf(stderr, "unknown option: %c\n", c);
+      usage(argv);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    fprintf(stderr, "Excess non-options: ");
+    while (optind < argc)
+      fprintf(stderr, "%s ", argv[optind++]);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+  }
+  if (num_workers > 0 && p.device_interactive) {
+    fprintf(stderr, "-i cannot be used with -j.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (mkdir(p.output_dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create %s: %s\n", p.output_dir, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  p.rows = (p.height + p.tile_size - 1) / p.tile_size;
+  p.cols = (p.width + p.tile_size - 1) / p.tile_size;
+  write_index(p.output_dir, p.height, p.width, p.tile_size, p.rows, p.cols);
+
+  int64_t start = lys_wall_time();
+  if (num_workers > 0) {
+    render_farm(&p, num_workers);
+  } else {
+    render_local(&p);
+  }
+  int64_t end = lys_wall_time();
+
+  double seconds = ((double)end-start)/1000000;
+  printf("Rendered %dx%d pixels as %d tiles in %fs (%f megapixels per second)\n",
+         p.width, p.height, p.rows * p.cols, seconds,
+         (double)p.width * p.height / seconds / 1e6);
+
+  return EXIT_SUCCESS;
+}
@@ -19,18 +19,21 @@ static void window_size_updated(struct lys_context *ctx, int newx, int newy) {
   ctx->height = newy;
 
   struct futhark_opaque_state *new_state;
+  int64_t start = lys_wall_time();
   FUT_CHECK(ctx->fut, futhark_entry_resize(ctx->fut, &new_state, ctx->height, ctx->width, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
+  lys_metrics_entry(LYS_ENTRY_RESIZE, start);
+  lys_state_created();
+  lys_free_state(ctx->fut, ctx->state);
   ctx->state = new_state;
+  ctx->job.idle = false;
 
   ctx->wnd_surface = SDL_GetWindowSurface(ctx->wnd);
   SDL_ASSERT(ctx->wnd_surface != NULL);
 
-  if (ctx->data != NULL) {
-    free(ctx->data);
-  }
-  ctx->data = malloc(ctx->width * ctx->height * sizeof(uint32_t));
-  assert(ctx->data != NULL);
+  // With LYS_HOST_FRAMES the surface is pointed at each frame instead.
+#ifndef LYS_HOST_FRAMES
+  ctx->data = lys_buffer_reserve(&ctx->data_buffer, ctx->width * ctx->height * sizeof(uint32_t));
+#endif
 
   if (ctx->surface != NULL) {
     SDL_FreeSurface(ctx->surface);
@@ -42,7 +45,22 @@ static void window_size_updated(struct lys_context *ctx, int newx, int newy) {
   trigger_event(ctx, LYS_WINDOW_SIZE_UPDATED);
 }
 
-static void mouse_event(struct lys_context *ctx, Uint32 state, int x, int y) {
+// Point the surface we blit from at 'frame', which moves every frame
+// with LYS_HOST_FRAMES or when exporting frames to shared memory.  The
+// surface does not own its pixels (SDL_PREALLOC), and the size only
+// changes in window_size_updated(), so just the pointer is replaced.
+static void set_surface_pixels(struct lys_context *ctx, uint32_t *frame) {
+  ctx->surface->pixels = frame;
+}
+
+void lys_submit_key(struct lys_context *ctx, int e, int keysym) {
+  struct lys_input input = { .kind = LYS_INPUT_KEY, .a = e, .b = keysym,
+                             .time = ctx->event_time };
+  lys_frame_job_submit(&ctx->job, &input);
+}
+
+static void submit_mouse(struct lys_context *ctx, enum lys_input_kind kind,
+                         int buttons, int x, int y) {
   // We ignore mouse events if we are running a program that would
   // like mouse grab, but where we have temporarily taken the mouse
   // back from it (to e.g. resize the window).
@@ -50,127 +68,108 @@ static void mouse_event(struct lys_context *ctx, Uint32 state, int x, int y) {
     return;
   }
 
-  struct futhark_opaque_state *new_state;
-  FUT_CHECK(ctx->fut, futhark_entry_mouse(ctx->fut, &new_state, state, x, y, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
-  ctx->state = new_state;
+  struct lys_input input = { .kind = kind, .a = buttons, .b = x, .c = y,
+                             .time = ctx->event_time };
+  lys_frame_job_submit(&ctx->job, &input);
 }
 
-static void wheel_event(struct lys_context *ctx, int x, int y) {
-  struct futhark_opaque_state *new_state;
-  FUT_CHECK(ctx->fut, futhark_entry_wheel(ctx->fut, &new_state, x, y, ctx->state));
-  futhark_free_opaque_state(ctx->fut, ctx->state);
-  ctx->state = new_state;
+void lys_submit_mouse(struct lys_context *ctx, int buttons, int x, int y) {
+  submit_mouse(ctx, LYS_INPUT_MOUSE, buttons, x, y);
 }
 
-static void handle_sdl_events(struct lys_context *ctx) {
-  SDL_Event event;
+void lys_submit_motion(struct lys_context *ctx, int buttons, int x, int y) {
+  submit_mouse(ctx, LYS_INPUT_MOTION, buttons, x, y);
+}
 
-  while (SDL_PollEvent(&event) == 1) {
-    switch (event.type) {
-    case SDL_WINDOWEVENT:
-      switch (event.window.event) {
-      case SDL_WINDOWEVENT_RESIZED:
-        {
-          int newx = (int)event.window.data1;
-          int newy = (int)event.window.data2;
-          window_size_updated(ctx, newx, newy);
-          break;
-        }
-      }
-      break;
-    case SDL_QUIT:
-      ctx->running = 0;
-      break;
-    case SDL_MOUSEMOTION:
-      if (ctx->grab_mouse) {
-        mouse_event(ctx, event.motion.state, event.motion.xrel, event.motion.yrel);
-      } else {
-        mouse_event(ctx, event.motion.state, event.motion.x, event.motion.y);
-      }
+void lys_submit_wheel(struct lys_context *ctx, int dx, int dy) {
+  struct lys_input input = { .kind = LYS_INPUT_WHEEL, .a = dx, .b = dy,
+                             .time = ctx->event_time };
+  lys_frame_job_submit(&ctx->job, &input);
+}
+
+void lys_submit_resize(struct lys_context *ctx, int width, int height) {
+  lys_resize_request(&ctx->resize, width, height);
+}
+
+void lys_submit_sdl_event(struct lys_context *ctx, const SDL_Event *event) {
+  // SDL timestamps events in milliseconds since SDL_Init(), so convert
+  // how long ago that was to our clock.
+  int64_t age = (int64_t)SDL_GetTicks() - event->common.timestamp;
+  ctx->event_time = lys_wall_time() - (age > 0 ? age * 1000 : 0);
+
+  switch (event->type) {
+  case SDL_WINDOWEVENT:
+    switch (event->window.event) {
+    case SDL_WINDOWEVENT_RESIZED:
+      lys_submit_resize(ctx, (int)event->window.data1, (int)event->window.data2);
       break;
-    case SDL_MOUSEBUTTONDOWN:
-    case SDL_MOUSEBUTTONUP:
-      if (ctx->grab_mouse && !ctx->mouse_grabbed) {
-        assert(SDL_SetRelativeMouseMode(1) == 0);
-        ctx->mouse_grabbed = 1;
-      }
+    }
+    break;
+  case SDL_QUIT:
+    ctx->running = 0;
+    break;
+  case SDL_MOUSEMOTION:
+    if (ctx->grab_mouse) {
+      lys_submit_motion(ctx, event->motion.state, event->motion.xrel, event->motion.yrel);
+    } else {
+      lys_submit_motion(ctx, event->motion.state, event->motion.x, event->motion.y);
+    }
+    break;
+  case SDL_MOUSEBUTTONDOWN:
+  case SDL_MOUSEBUTTONUP:
+    if (ctx->grab_mouse && !ctx->mouse_grabbed) {
+      assert(SDL_SetRelativeMouseMode(1) == 0);
+      ctx->mouse_grabbed = 1;
+    }
 
-      if (ctx->grab_mouse) {
-        mouse_event(ctx, 1<<(event.button.button-1), event.motion.xrel, event.motion.yrel);
-      } else {
-        mouse_event(ctx, 1<<(event.button.button-1), event.motion.x, event.motion.y);
+    if (ctx->grab_mouse) {
+      lys_submit_mouse(ctx, 1<<(event->button.button-1), event->motion.xrel, event->motion.yrel);
+    } else {
+      lys_submit_mouse(ctx, 1<<(event->button.button-1), event->motion.x, event->motion.y);
+    }
+    break;
+  case SDL_MOUSEWHEEL:
+    lys_submit_wheel(ctx, event->wheel.x, event->wheel.y);
+    break;
+  case SDL_KEYDOWN:
+  case SDL_KEYUP:
+    switch (event->key.keysym.sym) {
+    case SDLK_ESCAPE:
+      if (ctx->grab_mouse && ctx->mouse_grabbed) {
+        assert(SDL_SetRelativeMouseMode(0) == 0);
+        ctx->mouse_grabbed = 0;
+      } else if (event->key.type == SDL_KEYDOWN) {
+        ctx->running = 0;
       }
       break;
-    case SDL_MOUSEWHEEL:
-      wheel_event(ctx, event.wheel.x, event.wheel.y);
+    case SDLK_F1:
+      if (event->key.type == SDL_KEYDOWN) {
+        trigger_event(ctx, LYS_F1);
+      }
       break;
-    case SDL_KEYDOWN:
-    case SDL_KEYUP:
-      switch (event.key.keysym.sym) {
-      case SDLK_ESCAPE:
-        if (ctx->grab_mouse && ctx->mouse_grabbed) {
-          assert(SDL_SetRelativeMouseMode(0) == 0);
-          ctx->mouse_grabbed = 0;
-        } else if (event.key.type == SDL_KEYDOWN) {
-          ctx->running = 0;
-        }
-        break;
-      case SDLK_F1:
-        if (event.key.type == SDL_KEYDOWN) {
-          trigger_event(ctx, LYS_F1);
-        }
-        break;
-      default:
-        {
-          struct futhark_opaque_state *new_state;
-          int e = event.key.type == SDL_KEYDOWN ? 0 : 1;
-          FUT_CHECK(ctx->fut, futhark_entry_key(ctx->fut, &new_state,
-                                                e, event.key.keysym.sym, ctx->state));
-          futhark_free_opaque_state(ctx->fut, ctx->state);
-          ctx->state = new_state;
-        }
+    case SDLK_F2:
+      if (event->key.type == SDL_KEYDOWN) {
+        trigger_event(ctx, LYS_F2);
       }
+      break;
+    default:
+      lys_submit_key(ctx, event->key.type == SDL_KEYDOWN ? 0 : 1,
+                     event->key.keysym.sym);
     }
   }
-}
-
-static void sdl_loop(struct lys_context *ctx) {
-  struct futhark_u32_2d *out_arr;
 
-  while (ctx->running) {
-    int64_t now = lys_wall_time();
-    float delta = ((float)(now - ctx->last_time))/1000000.0;
-    ctx->fps = (ctx->fps*0.9 + (1/delta)*0.1);
-    ctx->last_time = now;
-    struct futhark_opaque_state *new_state, *old_state = ctx->state;
-    FUT_CHECK(ctx->fut, futhark_entry_step(ctx->fut, &new_state, delta, old_state));
-    ctx->state = new_state;
-
-    FUT_CHECK(ctx->fut, futhark_entry_render(ctx->fut, &out_arr, ctx->state));
-    FUT_CHECK(ctx->fut, futhark_values_u32_2d(ctx->fut, out_arr, ctx->data));
-    FUT_CHECK(ctx->fut, futhark_context_sync(ctx->fut));
-    FUT_CHECK(ctx->fut, futhark_free_u32_2d(ctx->fut, out_arr));
-    FUT_CHECK(ctx->fut, futhark_free_opaque_state(ctx->fut, old_state));
-
-    SDL_ASSERT(SDL_BlitSurface(ctx->surface, NULL, ctx->wnd_surface, NULL)==0);
-
-    trigger_event(ctx, LYS_LOOP_ITERATION);
-
-    SDL_ASSERT(SDL_UpdateWindowSurface(ctx->wnd) == 0);
+  ctx->event_time = 0;
+}
 
-    int delay =  1000.0/ctx->max_fps - delta*1000.0;
-    if (delay > 0) {
-      SDL_Delay(delay);
-    }
+static void handle_sdl_events(struct lys_context *ctx) {
+  SDL_Event event;
 
-    handle_sdl_events(ctx);
+  while (SDL_PollEvent(&event) == 1) {
+    lys_submit_sdl_event(ctx, &event);
   }
 }
 
-void lys_run_sdl(struct lys_context *ctx) {
-  struct futhark_context *fut = ctx->fut;
-
+void lys_open(struct lys_context *ctx) {
   ctx->last_time = lys_wall_time();
 
   ctx->wnd =
@@ -192,20 +191,138 @@ void lys_run_sdl(struct lys_context *ctx) {
     ctx->mouse_grabbed = 1;
   }
 
+  lys_frame_job_init(&ctx->job, ctx->fut);
+  ctx->job.relative_motion = ctx->grab_mouse;
+
   trigger_event(ctx, LYS_LOOP_START);
+}
 
-  sdl_loop(ctx);
+void lys_begin_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  int width, height;
+  if (lys_resize_settled(&ctx->resize, &width, &height)) {
+    window_size_updated(ctx, width, height);
+  }
+
+#ifdef LYS_HOT_RELOAD
+  if (lys_hot_reload(&ctx->job, &ctx->state, ctx->height, ctx->width)) {
+    FUT_CHECK(ctx->fut, futhark_entry_grab_mouse(ctx->fut, &ctx->grab_mouse));
+    ctx->job.relative_motion = ctx->grab_mouse;
+    trigger_event(ctx, LYS_PROGRAM_RELOADED);
+  }
+#endif
+
+  int64_t now = lys_wall_time();
+  ctx->delta = ((float)(now - ctx->last_time))/1000000.0;
+  ctx->fps = (ctx->fps*0.9 + (1/ctx->delta)*0.1);
+  ctx->last_time = now;
+}
 
-  FUT_CHECK(fut, futhark_free_opaque_state(fut, ctx->state));
+void lys_step_render_async(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  // With a CPU backend the frame is read straight from the array
+  // rendered by Futhark, unless it goes to shared memory.
+#ifdef LYS_HOST_FRAMES
+  uint32_t *dest = NULL;
+#else
+  uint32_t *dest = ctx->data;
+#endif
+  if (ctx->shm != NULL) {
+    dest = lys_shm_begin(ctx->shm, ctx->width, ctx->height);
+  }
+  lys_frame_job_start(&ctx->job, ctx->state, ctx->delta, dest);
+  ctx->state = NULL;
+  ctx->in_flight = true;
+}
+
+bool lys_frame_ready(struct lys_context *ctx) {
+  return !ctx->in_flight || lys_frame_job_done(&ctx->job);
+}
+
+void lys_await_frame(struct lys_context *ctx) {
+  if (!ctx->in_flight) {
+    return;
+  }
+  ctx->state = lys_frame_job_await(&ctx->job);
+  ctx->frame = ctx->job.frame;
+  ctx->in_flight = false;
+  if (ctx->shm != NULL) {
+    lys_shm_publish(ctx->shm);
+  }
+}
+
+void lys_present_frame(struct lys_context *ctx) {
+  assert(!ctx->in_flight);
+  set_surface_pixels(ctx, ctx->frame);
+
+  // Until a resize settles, keep showing frames of the old size in the
+  // resized window.
+  if (ctx->resize.pending) {
+    ctx->wnd_surface = SDL_GetWindowSurface(ctx->wnd);
+    SDL_ASSERT(ctx->wnd_surface != NULL);
+  }
+
+  SDL_ASSERT(SDL_BlitSurface(ctx->surface, NULL, ctx->wnd_surface, NULL)==0);
+
+  trigger_event(ctx, LYS_LOOP_ITERATION);
+
+  SDL_ASSERT(SDL_UpdateWindowSurface(ctx->wnd) == 0);
+  lys_frame_job_presented(&ctx->job, &ctx->latency);
+}
+
+void lys_close(struct lys_context *ctx) {
+  lys_await_frame(ctx);
+  lys_frame_job_free(&ctx->job);
+
+  lys_free_state(ctx->fut, ctx->state);
 
   trigger_event(ctx, LYS_LOOP_END);
 
   SDL_FreeSurface(ctx->surface);
+  lys_buffer_free(&ctx->data_buffer);
   // do not free wnd_surface (see SDL_GetWindowSurface)
   SDL_DestroyWindow(ctx->wnd);
   SDL_Quit();
 }
 
+static void sdl_loop(struct lys_context *ctx) {
+  while (ctx->running) {
+    lys_begin_frame(ctx);
+    if (lys_frame_job_idle(&ctx->job)) {
+      // Nothing changes until an event arrives, so show the last frame
+      // again (the window may need it) and sleep until one does.
+      lys_present_frame(ctx);
+      SDL_Event event;
+      if (SDL_WaitEventTimeout(&event, LYS_IDLE_TIMEOUT_MS) == 1) {
+        lys_submit_sdl_event(ctx, &event);
+      }
+      handle_sdl_events(ctx);
+      continue;
+    }
+    lys_step_render_async(ctx);
+    lys_await_frame(ctx);
+    lys_present_frame(ctx);
+
+    int delay =  1000.0/ctx->max_fps - ctx->delta*1000.0;
+    if (ctx->latency_priority) {
+      SDL_Event event;
+      if (delay > 0 && SDL_WaitEventTimeout(&event, delay) == 1) {
+        lys_submit_sdl_event(ctx, &event);
+      }
+    } else if (delay > 0) {
+      SDL_Delay(delay);
+    }
+
+    handle_sdl_events(ctx);
+  }
+}
+
+void lys_run_sdl(struct lys_context *ctx) {
+  lys_open(ctx);
+  sdl_loop(ctx);
+  lys_close(ctx);
+}
+
 void lys_setup(struct lys_context *ctx, int width, int height, int max_fps, int sdl_flags) {
   memset(ctx, 0, sizeof(struct lys_context));
   ctx->width = width;
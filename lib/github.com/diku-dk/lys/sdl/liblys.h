@@ -11,13 +11,17 @@
 #include PROGHEADER
 
 #include "shared.h"
+#include "shm.h"
 
 enum lys_event {
   LYS_LOOP_START,
   LYS_LOOP_ITERATION,
   LYS_LOOP_END,
   LYS_WINDOW_SIZE_UPDATED,
-  LYS_F1
+  LYS_F1,
+  LYS_F2,
+  // The program was rebuilt and reloaded (LYS_HOT_RELOAD).
+  LYS_PROGRAM_RELOADED
 };
 
 struct lys_context {
@@ -40,6 +44,21 @@ struct lys_context {
   void (*event_handler)(struct lys_context*, enum lys_event);
   TTF_Font *font;
   int font_size;
+  // If non-NULL, frames are rendered into this shared memory ring
+  // rather than into 'data'.
+  struct lys_shm *shm;
+  float delta;
+  uint32_t *frame;
+  bool in_flight;
+  struct lys_buffer data_buffer;
+  struct lys_resize resize;
+  struct lys_frame_job job;
+  struct lys_latency latency;
+  // Arrival time of the SDL event being submitted, or 0 for now.
+  int64_t event_time;
+  // Set before lys_open() to start the next frame as soon as an event
+  // arrives, rather than sleeping until it is due.
+  bool latency_priority;
 };
 
 #define SDL_ASSERT(x) _sdl_assert(x, __FILE__, __LINE__)
@@ -53,8 +72,57 @@ static inline void _sdl_assert(int res, const char *file, int line) {
 
 void lys_setup(struct lys_context *ctx, int width, int height, int max_fps, int sdl_flags);
 
+// Runs the whole event-render loop, and is all most programs need.
+// It is built from the functions below, which can also be used to
+// drive frames from another event loop:
+//
+//   lys_open(ctx);
+//   while (...) {
+//     lys_begin_frame(ctx);
+//     lys_submit_sdl_event(ctx, &e); // At any time, also while in flight.
+//     lys_step_render_async(ctx);
+//     ...                            // Other work; lys_frame_ready() polls.
+//     lys_await_frame(ctx);
+//     lys_present_frame(ctx);
+//   }
+//   lys_close(ctx);
+//
+// Between lys_step_render_async() and lys_await_frame() the frame is
+// in flight: the state is owned by a background thread and the
+// Futhark context must not be used by anyone else.
 void lys_run_sdl(struct lys_context *ctx);
 
+// Creates the window.
+void lys_open(struct lys_context *ctx);
+
+// Measures the time since the last frame and applies the most recent
+// resize, if any.
+void lys_begin_frame(struct lys_context *ctx);
+
+// Queue events for the next step.  'e' is 0 for keydown, 1 for keyup.
+void lys_submit_key(struct lys_context *ctx, int e, int keysym);
+void lys_submit_mouse(struct lys_context *ctx, int buttons, int x, int y);
+// Like lys_submit_mouse(), for motion without a change of buttons,
+// which may be merged with the motion before it.
+void lys_submit_motion(struct lys_context *ctx, int buttons, int x, int y);
+void lys_submit_wheel(struct lys_context *ctx, int dx, int dy);
+void lys_submit_resize(struct lys_context *ctx, int width, int height);
+
+// Translate an SDL event and submit it.
+void lys_submit_sdl_event(struct lys_context *ctx, const SDL_Event *event);
+
+// Apply the submitted events, step and render in the background.
+void lys_step_render_async(struct lys_context *ctx);
+
+bool lys_frame_ready(struct lys_context *ctx);
+
+void lys_await_frame(struct lys_context *ctx);
+
+// Blit the frame and the text overlay to the window.
+void lys_present_frame(struct lys_context *ctx);
+
+void lys_close(struct lys_context *ctx);
+
 #ifdef LYS_TTF
 void draw_text(struct lys_context *ctx, TTF_Font *font, int font_size, char* buffer, int32_t colour,
                int x_start, int y_start);
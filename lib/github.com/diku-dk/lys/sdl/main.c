@@ -1,6 +1,7 @@
 #include "liblys.h"
 #include "font_data.h"
 #include PRINTFHEADER
+#include "metrics.h"
 
 #ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE
@@ -12,31 +13,108 @@
 #define INITIAL_HEIGHT 600
 
 bool show_text = true;
+int num_frames = -1;
+
+// For benchmarking: record frame times, and submit synthetic key
+// presses to exercise the event path.
+const char *bench_output = NULL;
+int synthetic_events = 0;
+struct lys_bench bench;
+
+// Live kernel profiling (-P), and the statistics overlay toggled with
+// F2.
+const char *profile_output = NULL;
+struct lys_profile profile;
+bool show_stats = false;
+char *stats_buffer = NULL;
+size_t stats_buffer_len = 0;
+
+// Thread placement (-a, -A), and frame jitter for the overlay and -B.
+const char *frontend_cpus = NULL;
+const char *worker_cpus = NULL;
+
+// Start frames as soon as input arrives (-L).
+bool latency_priority = false;
+
+// Memory use, and the budget (-M) beyond which we stop.
+struct lys_memory memory;
+int64_t memory_budget = 0;
+bool memory_exceeded = false;
+
+// Counters served for monitoring (-m).
+const char *metrics_address = NULL;
+struct lys_metrics_server *metrics_server = NULL;
+struct lys_frame_stats frame_stats;
+
+void bench_iteration(struct lys_context *ctx) {
+  if (bench_output != NULL) {
+    lys_bench_frame(&bench);
+  }
+  for (int i = 0; i < synthetic_events; i++) {
+    int key = 'a' + i % 26;
+    lys_submit_key(ctx, 0, key);
+    lys_submit_key(ctx, 1, key);
+  }
+}
 
 void loop_start(struct lys_context *ctx, struct lys_text *text) {
   prepare_text(ctx->fut, text);
   text->show_text = show_text;
+  stats_buffer_len = text->text_buffer_len + LYS_STATS_BUFFER_SIZE;
+  stats_buffer = malloc(stats_buffer_len);
+  assert(stats_buffer != NULL);
 }
 
 void loop_iteration(struct lys_context *ctx, struct lys_text *text) {
-  if (!text->show_text) {
+  lys_frame_stats_frame(&frame_stats);
+  lys_metrics_frame(ctx->job.idle);
+  if (profile_output != NULL) {
+    lys_profile_frame(&profile, ctx->fut);
+  }
+  if ((memory_budget > 0 || show_stats || metrics_server != NULL) &&
+      !lys_memory_frame(&memory, ctx->fut, profile_output != NULL ? &profile : NULL)) {
+    memory_exceeded = true;
+    ctx->running = 0;
+  }
+  if (!text->show_text && !show_stats) {
+#ifdef LYS_DEVICE_TEXT
+    lys_frame_job_set_text(&ctx->job, "", 0, ctx->height, ctx->width);
+#endif
     return;
   }
 
-  build_text(ctx, text->text_buffer, text->text_buffer_len, text->text_format,
-             ctx->fps, text->sum_names);
-  if (*(text->text_buffer) != '\0') {
-    int32_t text_colour;
+  char *overlay = text->text_buffer;
+  if (text->show_text) {
+    build_text(ctx, text->text_buffer, text->text_buffer_len, text->text_format,
+               ctx->fps, text->sum_names);
+  } else {
+    text->text_buffer[0] = '\0';
+  }
+  if (show_stats) {
+    lys_build_stats(stats_buffer, stats_buffer_len, text->text_buffer,
+                    &frame_stats, &ctx->latency, &memory,
+                    profile_output != NULL ? &profile : NULL);
+    overlay = stats_buffer;
+  }
+  int32_t text_colour = 0;
+  if (*overlay != '\0') {
     FUT_CHECK(ctx->fut,
               futhark_entry_text_colour(ctx->fut, (uint32_t*) &text_colour,
                                         ctx->state));
-    draw_text(ctx, ctx->font, ctx->font_size, text->text_buffer, text_colour, 10, 10);
+#ifndef LYS_DEVICE_TEXT
+    draw_text(ctx, ctx->font, ctx->font_size, overlay, text_colour, 10, 10);
+#endif
   }
+#ifdef LYS_DEVICE_TEXT
+  // Composited into the following frames by the Futhark program.
+  lys_frame_job_set_text(&ctx->job, overlay, text_colour, ctx->height, ctx->width);
+#endif
 }
 
 void loop_end(struct lys_text *text) {
   free(text->text_format);
   free(text->text_buffer);
+  free(stats_buffer);
 
   for (size_t i = 0; i < n_printf_arguments(); i++) {
     if (text->sum_names[i] != NULL) {
@@ -82,6 +160,18 @@ void f1(struct lys_text *text) {
   text->show_text = !text->show_text;
 }
 
+void f2(void) {
+  show_stats = !show_stats;
+}
+
+// The text format may have changed, so prepare it again.
+void program_reloaded(struct lys_context *ctx, struct lys_text *text) {
+  bool show = text->show_text;
+  loop_end(text);
+  loop_start(ctx, text);
+  text->show_text = show;
+}
+
 void handle_event(struct lys_context *ctx, enum lys_event event) {
   struct lys_text *text = (struct lys_text *) ctx->event_handler_data;
   switch (event) {
@@ -90,6 +180,10 @@ void handle_event(struct lys_context *ctx, enum lys_event event) {
     break;
   case LYS_LOOP_ITERATION:
     loop_iteration(ctx, text);
+    bench_iteration(ctx);
+    if (num_frames > 0 && --num_frames == 0) {
+      ctx->running = 0;
+    }
     break;
   case LYS_LOOP_END:
     loop_end(text);
@@ -99,6 +193,12 @@ void handle_event(struct lys_context *ctx, enum lys_event event) {
     break;
   case LYS_F1:
     f1(text);
+    break;
+  case LYS_F2:
+    f2();
+    break;
+  case LYS_PROGRAM_RELOADED:
+    program_reloaded(ctx, text);
   }
 }
 
@@ -153,6 +253,16 @@ void usage(char **argv) {
   puts("  -t      Do not show text by default.");
   puts("  -i      Select execution device interactively.");
   puts("  -b <render|step>  Benchmark program.");
+  puts("  -S NAME[:SLOTS]   Also publish frames in shared memory /NAME.");
+  puts("  -f INT  Exit after this many frames.");
+  puts("  -E INT  Submit this many synthetic key presses per frame.");
+  puts("  -B FILE Write frame time statistics to FILE as JSON.");
+  puts("  -P FILE Profile kernels, and write a report to FILE.");
+  puts("  -a CPUS Run the frontend on these CPUs, such as 0-3,8.");
+  puts("  -A CPUS Run the Futhark code on these CPUs.");
+  puts("  -L      Start frames as soon as input arrives, for lower latency.");
+  puts("  -M MIB  Stop if Futhark and frame buffers use more memory.");
+  puts("  -m ADDR Serve metrics on this localhost port, or unix:PATH.");
 }
 
 int main(int argc, char** argv) {
@@ -161,9 +271,10 @@ int main(int argc, char** argv) {
   char *deviceopt = NULL;
   bool device_interactive = false;
   char *benchopt = NULL;
+  char *shmopt = NULL;
 
   int c;
-  while ( (c = getopt(argc, argv, "w:h:r:Rtd:b:i")) != -1) {
+  while ( (c = getopt(argc, argv, "w:h:r:Rtd:b:iS:f:E:B:P:a:A:LM:m:")) != -1) {
     switch (c) {
     case 'w':
       width = atoi(optarg);
@@ -207,6 +318,48 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
       }
       break;
+    case 'S':
+      shmopt = optarg;
+      break;
+    case 'f':
+      num_frames = atoi(optarg);
+      if (num_frames <= 0) {
+        fprintf(stderr, "'%s' is not a number of frames.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'E':
+      synthetic_events = atoi(optarg);
+      if (synthetic_events < 0) {
+        fprintf(stderr, "'%s' is not a number of events.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'B':
+      bench_output = optarg;
+      break;
+    case 'P':
+      profile_output = optarg;
+      break;
+    case 'a':
+      frontend_cpus = optarg;
+      break;
+    case 'A':
+      worker_cpus = optarg;
+      break;
+    case 'L':
+      latency_priority = true;
+      break;
+    case 'm':
+      metrics_address = optarg;
+      break;
+    case 'M':
+      memory_budget = atoll(optarg) * 1024 * 1024;
+      if (memory_budget <= 0) {
+        fprintf(stderr, "'%s' is not a valid number of MiB.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     case '?':
       usage(argv);
       return EXIT_SUCCESS;
@@ -225,6 +378,20 @@ int main(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
 
+  // Before anything is allocated, so that it is first touched on the
+  // frontend's NUMA node.
+  if (!lys_set_placement(frontend_cpus, worker_cpus)) {
+    exit(EXIT_FAILURE);
+  }
+
+  lys_metrics_init(max_fps);
+  if (metrics_address != NULL) {
+    metrics_server = lys_metrics_serve(metrics_address);
+    if (metrics_server == NULL) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
   int sdl_flags = 0;
   if (allow_resize) {
     sdl_flags |= SDL_WINDOW_RESIZABLE;
@@ -233,10 +400,19 @@ int main(int argc, char** argv) {
   struct lys_context ctx;
   struct futhark_context_config *futcfg;
   lys_setup(&ctx, width, height, max_fps, sdl_flags);
+  ctx.latency_priority = latency_priority;
+
+  if (shmopt != NULL) {
+    ctx.shm = lys_shm_create_from_option(shmopt);
+    if (ctx.shm == NULL) {
+      return EXIT_FAILURE;
+    }
+  }
 
   char* opencl_device_name = NULL;
   lys_setup_futhark_context(argv[0],
                             deviceopt, device_interactive,
+                            profile_output != NULL,
                             &futcfg, &ctx.fut, &opencl_device_name);
   if (opencl_device_name != NULL) {
     printf("Using OpenCL device: %s\n", opencl_device_name);
@@ -262,14 +438,47 @@ int main(int argc, char** argv) {
     int32_t seed = (int32_t) lys_wall_time();
     futhark_entry_init(ctx.fut, &ctx.state,
                        seed, ctx.height, ctx.width);
+    lys_state_created();
+    lys_bench_init(&bench);
+    lys_profile_init(&profile);
+    lys_frame_stats_init(&frame_stats);
+    lys_memory_init(&memory, memory_budget);
     lys_run_sdl(&ctx);
-    free(ctx.data);
+
+    if (profile_output != NULL &&
+        lys_profile_write(&profile, ctx.fut, profile_output) != 0) {
+      return EXIT_FAILURE;
+    }
+    lys_profile_free(&profile);
+
+    if (bench_output != NULL) {
+      lys_memory_sample(&memory, ctx.fut, NULL);
+    }
+    if (bench_output != NULL && lys_bench_write(&bench, bench_output, argv[0], &frame_stats, &ctx.latency, &memory) != 0) {
+      return EXIT_FAILURE;
+    }
+    lys_bench_free(&bench);
+
+    if (ctx.latency.num_samples > 0) {
+      fprintf(stderr, "Input-to-display latency over the last %d frames with input: p50 %.1fms, p99 %.1fms\n",
+              ctx.latency.num_samples,
+              lys_latency_percentile(&ctx.latency, 50)/1000.0,
+              lys_latency_percentile(&ctx.latency, 99)/1000.0);
+    }
   }
 
   TTF_CloseFont(ctx.font);
 
+  if (ctx.shm != NULL) {
+    lys_shm_free(ctx.shm);
+  }
+
+  if (metrics_server != NULL) {
+    lys_metrics_server_free(metrics_server);
+  }
+
   futhark_context_free(ctx.fut);
   futhark_context_config_free(futcfg);
 
-  return EXIT_SUCCESS;
+  return memory_exceeded ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -24,8 +24,10 @@ PKG_LDFLAGS=$(shell pkg-config --libs $(PKG_CFLAGS_PKGS))
 
 else ifeq ($(LYS_FRONTEND),console)
 
+else ifeq ($(LYS_FRONTEND),net)
+
 else
-$(error Unknown LYS_FRONTEND: $(LYS_FRONTEND).  Must be 'sdl' or 'console')
+$(error Unknown LYS_FRONTEND: $(LYS_FRONTEND).  Must be 'sdl', 'console', or 'net')
 endif
 
 NOWARN_CFLAGS=-std=gnu11 -O
@@ -49,10 +51,17 @@ else ifeq ($(LYS_BACKEND),hip)
 DEVICE_LDFLAGS=-lamdhip64 -lhiprtc
 else ifeq ($(LYS_BACKEND),c)
 DEVICE_LDFLAGS=
+CFLAGS+= -DLYS_HOST_FRAMES
 else ifeq ($(LYS_BACKEND),multicore)
 DEVICE_LDFLAGS=-lpthread
+CFLAGS+= -DLYS_HOST_FRAMES
 else
 $(error Unknown LYS_BACKEND: $(LYS_BACKEND).  Must be 'opencl', 'cuda', 'hip', 'multicore', or 'c')
 endif
 
-LDFLAGS?=-lm $(PKG_LDFLAGS) $(DEVICE_LDFLAGS)
+# Older versions of glibc keep shm_open() in librt.
+ifeq ($(shell uname -s),Linux)
+SHM_LDFLAGS=-lrt
+endif
+
+LDFLAGS?=-lm -lpthread $(PKG_LDFLAGS) $(DEVICE_LDFLAGS) $(SHM_LDFLAGS)
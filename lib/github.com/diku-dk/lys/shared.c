@@ -1,5 +1,139 @@
+// For the CPU affinity functions; must come before any system header.
+#define _GNU_SOURCE
 #include "shared.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef LYS_DEVICE_TEXT
+// Generated from the font by font_atlas.c.
+#include "font_atlas.h"
+#endif
+
+#ifdef LYS_HOT_RELOAD
+#include <dlfcn.h>
+#include <fcntl.h>
+#endif
+
+// For struct lys_memory.  States are created and freed by both the
+// frontend and the frame job thread.
+static _Atomic int64_t states_alive, states_peak;
+static int64_t host_bytes, host_peak;
+
+void lys_state_created(void) {
+  int64_t n = atomic_fetch_add(&states_alive, 1) + 1;
+  int64_t peak = atomic_load(&states_peak);
+  while (n > peak && !atomic_compare_exchange_weak(&states_peak, &peak, n)) {
+  }
+}
+
+void lys_free_state(struct futhark_context *fut, struct futhark_opaque_state *state) {
+  FUT_CHECK(fut, futhark_free_opaque_state(fut, state));
+  atomic_fetch_sub(&states_alive, 1);
+}
+
+bool lys_remove_stale_socket(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    fprintf(stderr, "Cannot use %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "%s exists and is not a socket; not replacing it.\n", path);
+    return false;
+  }
+  unlink(path);
+  return true;
+}
+
+// Thread placement, see lys_set_placement().
+static struct {
+  const char *frontend_cpus;
+  const char *worker_cpus;
+#ifdef __linux__
+  cpu_set_t frontend;
+  cpu_set_t worker;
+#endif
+} placement;
+
+#ifdef __linux__
+// Parse a list such as "0-7,16".
+static bool parse_cpus(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s != '\0') {
+    char *end;
+    long first = strtol(s, &end, 10), last = first;
+    if (end == s) {
+      return false;
+    }
+    s = end;
+    if (*s == '-') {
+      last = strtol(s+1, &end, 10);
+      if (end == s+1) {
+        return false;
+      }
+      s = end;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long i = first; i <= last; i++) {
+      CPU_SET(i, set);
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s != '\0') {
+      return false;
+    }
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+static void pin_thread(const cpu_set_t *set) {
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+  if (err != 0) {
+    fprintf(stderr, "Cannot set CPU affinity: %s\n", strerror(err));
+  }
+}
+#endif
+
+bool lys_set_placement(const char *frontend_cpus, const char *worker_cpus) {
+#ifdef __linux__
+  if (frontend_cpus != NULL && !parse_cpus(frontend_cpus, &placement.frontend)) {
+    fprintf(stderr, "'%s' is not a valid list of CPUs.\n", frontend_cpus);
+    return false;
+  }
+  if (worker_cpus != NULL && !parse_cpus(worker_cpus, &placement.worker)) {
+    fprintf(stderr, "'%s' is not a valid list of CPUs.\n", worker_cpus);
+    return false;
+  }
+  placement.frontend_cpus = frontend_cpus;
+  placement.worker_cpus = worker_cpus;
+  if (frontend_cpus != NULL) {
+    pin_thread(&placement.frontend);
+  }
+  return true;
+#else
+  if (frontend_cpus != NULL || worker_cpus != NULL) {
+    fprintf(stderr, "CPU placement is only supported on Linux.\n");
+    return false;
+  }
+  return true;
+#endif
+}
 
 const char* get_basename(const char *progname) {
   int n = strlen(progname);
@@ -12,14 +146,17 @@ const char* get_basename(const char *progname) {
   return &progname[i+1];
 }
 
-void lys_setup_futhark_context(const char *progname,
-                               const char *deviceopt, bool device_interactive,
-                               struct futhark_context_config* *futcfg,
-                               struct futhark_context* *futctx,
-                               char* *opencl_device_name) {
+static void setup_context(const char *progname,
+                          const char *deviceopt, bool device_interactive,
+                          bool profiling,
+                          struct futhark_context_config* *futcfg,
+                          struct futhark_context* *futctx,
+                          char* *opencl_device_name) {
   *futcfg = futhark_context_config_new();
   assert(*futcfg != NULL);
 
+  futhark_context_config_set_profiling(*futcfg, profiling);
+
 #if defined(FUTHARK_BACKEND_opencl) || defined(FUTHARK_BACKEND_cuda)
   if (deviceopt != NULL) {
     futhark_context_config_set_device(*futcfg, deviceopt);
@@ -44,9 +181,29 @@ void lys_setup_futhark_context(const char *progname,
     futhark_context_config_set_cache_file(*futcfg, buf);
   }
 
+#ifdef __linux__
+  // Threads inherit the affinity of their creator, so create the
+  // context (and with the multicore backend its worker threads) while
+  // pinned to the worker CPUs.
+  cpu_set_t old_set;
+  if (placement.worker_cpus != NULL) {
+#ifdef FUTHARK_BACKEND_multicore
+    futhark_context_config_set_num_threads(*futcfg, CPU_COUNT(&placement.worker));
+#endif
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &old_set) == 0);
+    pin_thread(&placement.worker);
+  }
+#endif
+
   *futctx = futhark_context_new(*futcfg);
   assert(*futctx != NULL);
 
+#ifdef __linux__
+  if (placement.worker_cpus != NULL) {
+    pin_thread(&old_set);
+  }
+#endif
+
 #ifdef FUTHARK_BACKEND_opencl
   cl_device_id device;
   assert(clGetCommandQueueInfo(futhark_context_get_command_queue(*futctx),
@@ -64,12 +221,1221 @@ void lys_setup_futhark_context(const char *progname,
 #endif
 }
 
+#ifdef LYS_HOT_RELOAD
+lys_function lys_futhark_functions[LYS_FUTHARK_NUM_FUNCTIONS];
+
+#define LYS_FUTHARK_NAME(f) #f,
+static const char *futhark_function_names[] = { LYS_FUTHARK_FUNCTIONS(LYS_FUTHARK_NAME) };
+
+// What lys_setup_futhark_context() was called with, so that we can
+// set up a context for the reloaded program in the same way.
+static struct {
+  void *library;
+  struct timespec mtime;
+  int64_t last_check;
+  const char *progname;
+  const char *deviceopt;
+  bool profiling;
+  struct futhark_context_config* *futcfg;
+  struct futhark_context* *futctx;
+} hot;
+
+// dlopen() returns the already loaded library if asked for the same
+// file name again, and the build may overwrite the file while we use
+// it, so we load a private copy.
+static void* open_library_copy(const char *path) {
+  char copy[] = "/tmp/lys-XXXXXX";
+  int out = mkstemp(copy);
+  if (out < 0) {
+    fprintf(stderr, "Cannot create %s: %s\n", copy, strerror(errno));
+    return NULL;
+  }
+  int in = open(path, O_RDONLY);
+  bool ok = in >= 0;
+  char buf[65536];
+  ssize_t n;
+  while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+    ok = n > 0 && write(out, buf, n) == n;
+  }
+  if (in >= 0) {
+    close(in);
+  }
+  close(out);
+
+  void *library = NULL;
+  if (!ok) {
+    fprintf(stderr, "Cannot copy %s: %s\n", path, strerror(errno));
+  } else if ((library = dlopen(copy, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+    fprintf(stderr, "Cannot load %s: %s\n", path, dlerror());
+  }
+  unlink(copy);
+  return library;
+}
+
+// Load the library and look up its functions in 'functions'.
+static void* load_library(lys_function *functions) {
+  struct stat st;
+  if (stat(LYS_HOT_RELOAD_LIBRARY, &st) != 0) {
+    fprintf(stderr, "Cannot stat %s: %s\n", LYS_HOT_RELOAD_LIBRARY, strerror(errno));
+    return NULL;
+  }
+  hot.mtime = st.st_mtim;
+
+  void *library = open_library_copy(LYS_HOT_RELOAD_LIBRARY);
+  if (library == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < LYS_FUTHARK_NUM_FUNCTIONS; i++) {
+    void *f = dlsym(library, futhark_function_names[i]);
+    if (f == NULL) {
+      fprintf(stderr, "%s does not define %s.\n",
+              LYS_HOT_RELOAD_LIBRARY, futhark_function_names[i]);
+      dlclose(library);
+      return NULL;
+    }
+    *(void**)(&functions[i]) = f;
+  }
+  // build_text() calls text_content through the prototype it was
+  // compiled with, so its outputs must not change.
+  const char *signature = dlsym(library, "lys_text_content_signature");
+  if (signature == NULL || strcmp(signature, lys_text_content_signature) != 0) {
+    fprintf(stderr, "%s changes the types of text_content; restart to load it.\n",
+            LYS_HOT_RELOAD_LIBRARY);
+    dlclose(library);
+    return NULL;
+  }
+  return library;
+}
+
+void lys_setup_futhark_context(const char *progname,
+                               const char *deviceopt, bool device_interactive,
+                               bool profiling,
+                               struct futhark_context_config* *futcfg,
+                               struct futhark_context* *futctx,
+                               char* *opencl_device_name) {
+  hot.library = load_library(lys_futhark_functions);
+  if (hot.library == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  hot.last_check = lys_wall_time();
+  hot.progname = progname;
+  hot.deviceopt = deviceopt;
+  hot.profiling = profiling;
+  hot.futcfg = futcfg;
+  hot.futctx = futctx;
+  setup_context(progname, deviceopt, device_interactive, profiling,
+                futcfg, futctx, opencl_device_name);
+}
+
+static void release_frame(struct lys_frame_job *job);
+static void read_interest(struct lys_frame_job *job);
+#ifdef LYS_DEVICE_TEXT
+static void upload_atlas(struct lys_frame_job *job);
+#endif
+
+bool lys_hot_reload(struct lys_frame_job *job, struct futhark_opaque_state **state,
+                    int height, int width) {
+  int64_t now = lys_wall_time();
+  if (now - hot.last_check < LYS_HOT_RELOAD_INTERVAL_US) {
+    return false;
+  }
+  hot.last_check = now;
+
+  struct stat st;
+  if (stat(LYS_HOT_RELOAD_LIBRARY, &st) != 0 ||
+      (st.st_mtim.tv_sec == hot.mtime.tv_sec &&
+       st.st_mtim.tv_nsec == hot.mtime.tv_nsec)) {
+    return false;
+  }
+
+  // If the new library cannot be loaded (perhaps it is still being
+  // written), keep running the old one until the file changes again.
+  lys_function functions[LYS_FUTHARK_NUM_FUNCTIONS];
+  void *library = load_library(functions);
+  if (library == NULL) {
+    return false;
+  }
+
+  // The last frame has been presented, so we can let go of it.  A new
+  // one must then be rendered, even if the program was idle.
+  release_frame(job);
+  job->idle = false;
+
+  struct futhark_context *fut = *hot.futctx;
+#ifdef LYS_DEVICE_TEXT
+  FUT_CHECK(fut, futhark_free_u8_3d(fut, job->atlas));
+#endif
+  void *bytes = NULL;
+  size_t num_bytes;
+  FUT_CHECK(fut, futhark_store_opaque_state(fut, *state, &bytes, &num_bytes));
+  lys_free_state(fut, *state);
+  futhark_context_free(fut);
+  futhark_context_config_free(*hot.futcfg);
+  dlclose(hot.library);
+
+  hot.library = library;
+  memcpy(lys_futhark_functions, functions, sizeof(functions));
+
+  char *opencl_device_name;
+  setup_context(hot.progname, hot.deviceopt, false, hot.profiling,
+                hot.futcfg, hot.futctx, &opencl_device_name);
+  free(opencl_device_name);
+  fut = *hot.futctx;
+  job->fut = fut;
+  read_interest(job);
+#ifdef LYS_DEVICE_TEXT
+  upload_atlas(job);
+#endif
+
+  *state = futhark_restore_opaque_state(fut, bytes);
+  free(bytes);
+  if (*state == NULL) {
+    fprintf(stderr, "Reloaded %s, but the state type has changed; starting over.\n",
+            LYS_HOT_RELOAD_LIBRARY);
+    free(futhark_context_get_error(fut));
+    FUT_CHECK(fut, futhark_entry_init(fut, state, (int32_t) lys_wall_time(), height, width));
+  } else {
+    fprintf(stderr, "Reloaded %s.\n", LYS_HOT_RELOAD_LIBRARY);
+  }
+  lys_state_created();
+  return true;
+}
+#else
+void lys_setup_futhark_context(const char *progname,
+                               const char *deviceopt, bool device_interactive,
+                               bool profiling,
+                               struct futhark_context_config* *futcfg,
+                               struct futhark_context* *futctx,
+                               char* *opencl_device_name) {
+  setup_context(progname, deviceopt, device_interactive, profiling,
+                futcfg, futctx, opencl_device_name);
+}
+#endif
+
 int64_t lys_wall_time() {
   struct timeval time;
   assert(gettimeofday(&time,NULL) == 0);
   return time.tv_sec * 1000000 + time.tv_usec;
 }
 
+void lys_latency_record(struct lys_latency *latency, int64_t usecs) {
+  latency->samples[latency->next] = usecs;
+  latency->next = (latency->next + 1) % LYS_LATENCY_SAMPLES;
+  if (latency->num_samples < LYS_LATENCY_SAMPLES) {
+    latency->num_samples++;
+  }
+}
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+int64_t lys_latency_percentile(const struct lys_latency *latency, double p) {
+  int n = latency->num_samples;
+  if (n == 0) {
+    return -1;
+  }
+  int64_t sorted[LYS_LATENCY_SAMPLES];
+  memcpy(sorted, latency->samples, n * sizeof(int64_t));
+  qsort(sorted, n, sizeof(int64_t), cmp_int64);
+  int i = (int)(p / 100 * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+void lys_profile_init(struct lys_profile *profile) {
+  memset(profile, 0, sizeof(struct lys_profile));
+  profile->start = profile->window_start = lys_wall_time();
+  snprintf(profile->summary, sizeof(profile->summary), "Collecting profile...\n");
+}
+
+static struct lys_profile_kernel* profile_kernel(struct lys_profile *profile,
+                                                 const char *name, size_t len) {
+  for (int i = 0; i < profile->num_kernels; i++) {
+    if (strlen(profile->kernels[i].name) == len &&
+        strncmp(profile->kernels[i].name, name, len) == 0) {
+      return &profile->kernels[i];
+    }
+  }
+  if (profile->num_kernels == LYS_PROFILE_MAX_KERNELS) {
+    return NULL;
+  }
+  struct lys_profile_kernel *k = &profile->kernels[profile->num_kernels++];
+  memset(k, 0, sizeof(struct lys_profile_kernel));
+  k->name = strndup(name, len);
+  assert(k->name != NULL);
+  return k;
+}
+
+// Add up the events in a report, which consumes them.  The report is
+// JSON with an "events" array of objects with "name", "start" and
+// "end" (in microseconds) fields.  We only scan for those fields
+// rather than parse the JSON properly.
+static void profile_add_events(struct lys_profile *profile, const char *report) {
+  const char *p = strstr(report, "\"events\"");
+  while (p != NULL && (p = strstr(p, "\"name\":")) != NULL) {
+    p = strchr(p + 7, '"');
+    if (p == NULL) {
+      break;
+    }
+    const char *name = ++p;
+    while (*p != '\0' && !(*p == '"' && p[-1] != '\\')) {
+      p++;
+    }
+    size_t name_len = p - name;
+    const char *next = strstr(p, "\"name\":");
+    const char *start = strstr(p, "\"start\":");
+    const char *end = strstr(p, "\"end\":");
+    if (start == NULL || end == NULL ||
+        (next != NULL && (start > next || end > next))) {
+      continue;
+    }
+    double us = strtod(end + 6, NULL) - strtod(start + 8, NULL);
+    struct lys_profile_kernel *k = profile_kernel(profile, name, name_len);
+    if (k != NULL) {
+      k->calls++;
+      k->total_us += us;
+      k->window_us += us;
+    }
+  }
+}
+
+static void profile_collect(struct lys_profile *profile, struct futhark_context *fut) {
+  char *report = futhark_context_report(fut);
+  if (report == NULL) {
+    return;
+  }
+  profile_add_events(profile, report);
+  free(report);
+}
+
+static int cmp_window_us(const void *a, const void *b) {
+  const struct lys_profile_kernel *x = *(struct lys_profile_kernel* const*)a;
+  const struct lys_profile_kernel *y = *(struct lys_profile_kernel* const*)b;
+  return (x->window_us < y->window_us) - (x->window_us > y->window_us);
+}
+
+static int cmp_total_us(const void *a, const void *b) {
+  const struct lys_profile_kernel *x = *(struct lys_profile_kernel* const*)a;
+  const struct lys_profile_kernel *y = *(struct lys_profile_kernel* const*)b;
+  return (x->total_us < y->total_us) - (x->total_us > y->total_us);
+}
+
+void lys_profile_frame(struct lys_profile *profile, struct futhark_context *fut) {
+  profile->frames++;
+  profile->window_frames++;
+  int64_t now = lys_wall_time();
+  int64_t elapsed = now - profile->window_start;
+  if (elapsed < LYS_PROFILE_INTERVAL_US) {
+    return;
+  }
+  profile_collect(profile, fut);
+
+  struct lys_profile_kernel *sorted[LYS_PROFILE_MAX_KERNELS];
+  for (int i = 0; i < profile->num_kernels; i++) {
+    sorted[i] = &profile->kernels[i];
+  }
+  qsort(sorted, profile->num_kernels, sizeof(sorted[0]), cmp_window_us);
+
+  // Show the top kernels by their time per frame and their share of
+  // the wall clock time.
+  char *out = profile->summary;
+  size_t left = sizeof(profile->summary);
+  int n = snprintf(out, left, "Kernel                    ms/frame  share\n");
+  for (int i = 0; i < profile->num_kernels && i < 8 && sorted[i]->window_us > 0; i++) {
+    if (n < 0 || (size_t)n >= left) {
+      break;
+    }
+    out += n;
+    left -= n;
+    n = snprintf(out, left, "%-25.25s %8.3f %5.1f%%\n", sorted[i]->name,
+                 sorted[i]->window_us / 1000 / profile->window_frames,
+                 100 * sorted[i]->window_us / elapsed);
+  }
+  for (int i = 0; i < profile->num_kernels; i++) {
+    profile->kernels[i].window_us = 0;
+  }
+  profile->window_start = now;
+  profile->window_frames = 0;
+}
+
+int lys_profile_write(struct lys_profile *profile, struct futhark_context *fut,
+                      const char *path) {
+  profile_collect(profile, fut);
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct lys_profile_kernel *sorted[LYS_PROFILE_MAX_KERNELS];
+  for (int i = 0; i < profile->num_kernels; i++) {
+    sorted[i] = &profile->kernels[i];
+  }
+  qsort(sorted, profile->num_kernels, sizeof(sorted[0]), cmp_total_us);
+
+  double seconds = (lys_wall_time() - profile->start) / 1e6;
+  fprintf(f, "%ld frames in %.3fs.\n\n", (long)profile->frames, seconds);
+  fprintf(f, "%-40s %10s %12s %12s %10s %7s\n",
+          "Kernel", "Calls", "Total ms", "Mean us", "ms/frame", "Share");
+  for (int i = 0; i < profile->num_kernels; i++) {
+    struct lys_profile_kernel *k = sorted[i];
+    fprintf(f, "%-40s %10ld %12.3f %12.3f %10.3f %6.2f%%\n",
+            k->name, (long)k->calls, k->total_us / 1000, k->total_us / k->calls,
+            profile->frames > 0 ? k->total_us / 1000 / profile->frames : 0.0,
+            100 * k->total_us / 1e6 / seconds);
+  }
+  fclose(f);
+  return 0;
+}
+
+void lys_profile_free(struct lys_profile *profile) {
+  for (int i = 0; i < profile->num_kernels; i++) {
+    free(profile->kernels[i].name);
+  }
+}
+
+void lys_frame_stats_init(struct lys_frame_stats *stats) {
+  memset(stats, 0, sizeof(struct lys_frame_stats));
+  stats->cpu = stats->node = -1;
+}
+
+void lys_frame_stats_frame(struct lys_frame_stats *stats) {
+  int64_t now = lys_wall_time();
+  if (stats->last != 0) {
+    double ms = (now - stats->last) / 1000.0;
+    if (stats->mean_ms == 0) {
+      stats->mean_ms = ms;
+    }
+    stats->jitter_ms = stats->jitter_ms * 0.95 + fabs(ms - stats->mean_ms) * 0.05;
+    stats->mean_ms = stats->mean_ms * 0.95 + ms * 0.05;
+  }
+  stats->last = now;
+
+#ifdef __linux__
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+    if (stats->cpu >= 0 && (int)cpu != stats->cpu) {
+      stats->migrations++;
+    }
+    if (stats->node >= 0 && (int)node != stats->node) {
+      stats->node_changes++;
+    }
+    stats->cpu = cpu;
+    stats->node = node;
+  }
+#endif
+}
+
+void lys_memory_init(struct lys_memory *memory, int64_t budget) {
+  memset(memory, 0, sizeof(struct lys_memory));
+  memory->budget = budget;
+}
+
+// The "memory" object of a report maps the name of each space to its
+// peak use in bytes.
+static void memory_collect(struct lys_memory *memory, const char *report) {
+  const char *p = strstr(report, "\"memory\"");
+  p = p == NULL ? NULL : strchr(p, '{');
+  const char *end = p == NULL ? NULL : strchr(p, '}');
+  memory->context_peak = 0;
+  memory->spaces[0] = '\0';
+  size_t used = 0;
+  while (end != NULL && (p = strchr(p + 1, ':')) != NULL && p < end) {
+    // The name is the quoted string before the colon.
+    const char *name_end = p;
+    while (name_end > report && name_end[-1] != '"') {
+      name_end--;
+    }
+    const char *name = name_end - 1;
+    while (name > report && name[-1] != '"') {
+      name--;
+    }
+    long long bytes = strtoll(p + 1, NULL, 10);
+    memory->context_peak += bytes;
+    if (used < sizeof(memory->spaces) && name < name_end) {
+      used += snprintf(memory->spaces + used, sizeof(memory->spaces) - used,
+                       "%s%.*s: %.1f MiB", used == 0 ? "" : ", ",
+                       (int)(name_end - 1 - name), name, bytes / (1024.0*1024.0));
+    }
+  }
+}
+
+bool lys_memory_frame(struct lys_memory *memory, struct futhark_context *fut,
+                      struct lys_profile *profile) {
+  int64_t now = lys_wall_time();
+  if (now - memory->last_sample < LYS_MEMORY_INTERVAL_US) {
+    return true;
+  }
+  memory->last_sample = now;
+  return lys_memory_sample(memory, fut, profile);
+}
+
+bool lys_memory_sample(struct lys_memory *memory, struct futhark_context *fut,
+                       struct lys_profile *profile) {
+  char *report = futhark_context_report(fut);
+  if (report != NULL) {
+    memory_collect(memory, report);
+    if (profile != NULL) {
+      profile_add_events(profile, report);
+    }
+    free(report);
+  }
+  memory->host = host_bytes;
+  memory->host_peak = host_peak;
+  memory->states = atomic_load(&states_alive);
+  memory->states_peak = atomic_load(&states_peak);
+  atomic_store_explicit(&lys_metrics.context_peak, memory->context_peak, memory_order_relaxed);
+  atomic_store_explicit(&lys_metrics.host, memory->host, memory_order_relaxed);
+  atomic_store_explicit(&lys_metrics.states, memory->states, memory_order_relaxed);
+
+  if (memory->budget > 0 && memory->context_peak + memory->host > memory->budget) {
+    fprintf(stderr, "Memory budget of %.1f MiB exceeded:\n"
+            "  Futhark context peak: %.1f MiB (%s)\n"
+            "  Frame buffers: %.1f MiB\n"
+            "  Opaque states alive: %ld (peak %ld)\n",
+            memory->budget / (1024.0*1024.0),
+            memory->context_peak / (1024.0*1024.0), memory->spaces,
+            memory->host / (1024.0*1024.0),
+            (long)memory->states, (long)memory->states_peak);
+    return false;
+  }
+  return true;
+}
+
+struct lys_metrics lys_metrics;
+
+const char *lys_entry_names[LYS_NUM_ENTRIES] = {
+  "key", "mouse", "wheel", "step", "render", "needs_redraw", "resize", "values"
+};
+
+const int64_t lys_metrics_bucket_us[LYS_METRICS_BUCKETS] = {
+  4000, 8000, 12000, 17000, 25000, 34000, 50000, 100000, 250000, 1000000
+};
+
+void lys_metrics_init(int max_fps) {
+  lys_metrics.target_us = 1000000 / max_fps;
+}
+
+void lys_metrics_frame(bool idle) {
+  int64_t now = lys_wall_time();
+  struct lys_metrics *m = &lys_metrics;
+  atomic_fetch_add_explicit(&m->frames, 1, memory_order_relaxed);
+  if (m->last != 0) {
+    int64_t us = now - m->last;
+    int bucket = 0;
+    while (bucket < LYS_METRICS_BUCKETS && us > lys_metrics_bucket_us[bucket]) {
+      bucket++;
+    }
+    atomic_fetch_add_explicit(&m->frame_buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->frame_us, us, memory_order_relaxed);
+    // A frame that took n frame times, rounded, replaced n-1 frames.
+    if (!m->last_idle && m->target_us > 0) {
+      int64_t missed = (us + m->target_us/2) / m->target_us - 1;
+      if (missed > 0) {
+        atomic_fetch_add_explicit(&m->dropped_frames, missed, memory_order_relaxed);
+      }
+    }
+  }
+  m->last = now;
+  m->last_idle = idle;
+}
+
+void lys_metrics_entry(enum lys_entry entry, int64_t start) {
+  int64_t us = lys_wall_time() - start;
+  atomic_fetch_add_explicit(&lys_metrics.entry_calls[entry], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&lys_metrics.entry_us[entry], us, memory_order_relaxed);
+}
+
+// In milliseconds, and 0 if there are no samples.
+static double latency_ms(const struct lys_latency *latency, double p) {
+  int64_t usecs = lys_latency_percentile(latency, p);
+  return usecs < 0 ? 0 : usecs / 1000.0;
+}
+
+void lys_build_stats(char *out, size_t len, const char *text,
+                     const struct lys_frame_stats *stats,
+                     const struct lys_latency *latency,
+                     const struct lys_memory *memory,
+                     const struct lys_profile *profile) {
+  snprintf(out, len, "%s%sFrame: %.2f ms (%.1f FPS), jitter %.2f ms\n"
+           "Input latency: p50 %.1f ms, p99 %.1f ms (%d frames)\n"
+           "Memory: context peak %.1f MiB, frames %.1f MiB, %ld states\n"
+           "CPU %d, node %d, %ld migrations (-a %s, -A %s)\n%s",
+           text, *text == '\0' ? "" : "\n\n",
+           stats->mean_ms, stats->mean_ms > 0 ? 1000 / stats->mean_ms : 0.0,
+           stats->jitter_ms,
+           latency_ms(latency, 50), latency_ms(latency, 99), latency->num_samples,
+           memory->context_peak / (1024.0*1024.0), memory->host / (1024.0*1024.0),
+           (long)memory->states,
+           stats->cpu, stats->node, (long)stats->migrations,
+           placement.frontend_cpus != NULL ? placement.frontend_cpus : "any",
+           placement.worker_cpus != NULL ? placement.worker_cpus : "any",
+           profile != NULL ? profile->summary : "Profiling disabled (use -P FILE).\n");
+}
+
+void lys_bench_init(struct lys_bench *bench) {
+  memset(bench, 0, sizeof(struct lys_bench));
+}
+
+void lys_bench_frame(struct lys_bench *bench) {
+  int64_t now = lys_wall_time();
+  if (bench->start == 0) {
+    bench->start = bench->last = now;
+    return;
+  }
+  if (bench->num_frames == bench->capacity) {
+    bench->capacity = bench->capacity == 0 ? 256 : bench->capacity * 2;
+    bench->frame_times = realloc(bench->frame_times, bench->capacity * sizeof(int64_t));
+    assert(bench->frame_times != NULL);
+  }
+  bench->frame_times[bench->num_frames++] = now - bench->last;
+  bench->last = now;
+}
+
+int lys_bench_write(const struct lys_bench *bench, const char *path, const char *program,
+                    const struct lys_frame_stats *stats,
+                    const struct lys_latency *latency,
+                    const struct lys_memory *memory) {
+  int warmup = bench->num_frames / 10;
+  int n = bench->num_frames - warmup;
+  if (n <= 0) {
+    fprintf(stderr, "No frames to write benchmark results for.\n");
+    return 1;
+  }
+  int64_t *sorted = malloc(n * sizeof(int64_t));
+  assert(sorted != NULL);
+  memcpy(sorted, bench->frame_times + warmup, n * sizeof(int64_t));
+  qsort(sorted, n, sizeof(int64_t), cmp_int64);
+  int64_t total = 0;
+  for (int i = 0; i < n; i++) {
+    total += sorted[i];
+  }
+  double mean = (double)total / n, var = 0;
+  for (int i = 0; i < n; i++) {
+    var += (sorted[i] - mean) * (sorted[i] - mean);
+  }
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    free(sorted);
+    return 1;
+  }
+  fprintf(f, "{\"program\": \"%s\", \"frames\": %d, \"warmup_frames\": %d, "
+          "\"seconds\": %f,\n \"frame_ms\": {\"mean\": %f, \"p50\": %f, "
+          "\"p90\": %f, \"p99\": %f, \"max\": %f, \"stddev\": %f},\n"
+          " \"placement\": {\"frontend_cpus\": \"%s\", \"worker_cpus\": \"%s\", "
+          "\"migrations\": %ld, \"node_changes\": %ld},\n"
+          " \"latency_ms\": {\"p50\": %f, \"p99\": %f, \"samples\": %d},\n"
+          " \"memory\": {\"context_peak\": %ld, \"host\": %ld, \"host_peak\": %ld, "
+          "\"states\": %ld, \"states_peak\": %ld}}\n",
+          get_basename(program), n, warmup, total / 1e6, mean / 1e3,
+          sorted[(int)(0.50 * (n - 1))] / 1e3,
+          sorted[(int)(0.90 * (n - 1))] / 1e3,
+          sorted[(int)(0.99 * (n - 1))] / 1e3,
+          sorted[n - 1] / 1e3,
+          sqrt(var / n) / 1e3,
+          placement.frontend_cpus != NULL ? placement.frontend_cpus : "",
+          placement.worker_cpus != NULL ? placement.worker_cpus : "",
+          (long)stats->migrations, (long)stats->node_changes,
+          latency_ms(latency, 50), latency_ms(latency, 99),
+          latency->num_samples,
+          (long)memory->context_peak, (long)memory->host, (long)memory->host_peak,
+          (long)memory->states, (long)memory->states_peak);
+  fclose(f);
+  free(sorted);
+  return 0;
+}
+
+void lys_bench_free(struct lys_bench *bench) {
+  free(bench->frame_times);
+}
+
+bool lys_golden_open(struct lys_golden *golden, const char *path, bool verify) {
+  memset(golden, 0, sizeof(struct lys_golden));
+  golden->file = fopen(path, verify ? "r" : "w");
+  if (golden->file == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  golden->path = path;
+  golden->verify = verify;
+  return true;
+}
+
+// Four independent lanes, so that the loop can be vectorised, each of
+// which is multiplied by the 64-bit FNV prime after every pixel.
+static uint64_t hash_pixels(uint64_t h, const uint32_t *p, int n) {
+  uint64_t lanes[4] = { h, h ^ 0x9E3779B97F4A7C15u, h ^ 0xC2B2AE3D27D4EB4Fu, h ^ 0x165667B19E3779F9u };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      lanes[k] = (lanes[k] ^ p[i+k]) * 1099511628211u;
+    }
+  }
+  for (; i < n; i++) {
+    lanes[0] = (lanes[0] ^ p[i]) * 1099511628211u;
+  }
+  h = lanes[0] ^ (lanes[1] << 16 | lanes[1] >> 48)
+    ^ (lanes[2] << 32 | lanes[2] >> 32) ^ (lanes[3] << 48 | lanes[3] >> 16);
+  h *= 0x9E3779B97F4A7C15u;
+  return h ^ (h >> 29);
+}
+
+// The rows and columns of region 'r' along a side of 'n' pixels.
+static int region_start(int r, int n) {
+  return (int)((int64_t)r * n / LYS_GOLDEN_GRID);
+}
+
+static void golden_hash(const uint32_t *pixels, int height, int width,
+                        uint64_t hashes[LYS_GOLDEN_GRID*LYS_GOLDEN_GRID]) {
+  for (int i = 0; i < LYS_GOLDEN_GRID*LYS_GOLDEN_GRID; i++) {
+    hashes[i] = i;
+  }
+  for (int y = 0; y < height; y++) {
+    uint64_t *row = &hashes[(y * LYS_GOLDEN_GRID / height) * LYS_GOLDEN_GRID];
+    for (int r = 0; r < LYS_GOLDEN_GRID; r++) {
+      int x0 = region_start(r, width), x1 = region_start(r+1, width);
+      row[r] = hash_pixels(row[r], &pixels[(size_t)y*width + x0], x1 - x0);
+    }
+  }
+}
+
+static void golden_diff(const struct lys_golden *golden, const bool *differs,
+                        const uint32_t *pixels, int height, int width) {
+  int bufsize = strlen(golden->path) + 16;
+  char path[bufsize];
+  snprintf(path, bufsize, "%s.diff.ppm", golden->path);
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int y = 0; y < height; y++) {
+    const bool *row = &differs[(y * LYS_GOLDEN_GRID / height) * LYS_GOLDEN_GRID];
+    for (int r = 0; r < LYS_GOLDEN_GRID; r++) {
+      int shift = row[r] ? 0 : 2;
+      for (int x = region_start(r, width); x < region_start(r+1, width); x++) {
+        uint32_t p = pixels[(size_t)y*width + x];
+        fputc(((p >> 16) & 0xFF) >> shift, f);
+        fputc(((p >> 8) & 0xFF) >> shift, f);
+        fputc((p & 0xFF) >> shift, f);
+      }
+    }
+  }
+  fclose(f);
+  fprintf(stderr, "The frame is in %s, with the regions that differ highlighted.\n", path);
+}
+
+// Compare 'hashes' with the next line of the file, and explain any
+// difference.
+static bool golden_check(const struct lys_golden *golden, const char *label,
+                         const uint64_t *hashes,
+                         const uint32_t *pixels, int height, int width) {
+  char recorded_label[64];
+  int recorded_width, recorded_height;
+  if (fscanf(golden->file, "%63s %dx%d", recorded_label,
+             &recorded_width, &recorded_height) != 3) {
+    fprintf(stderr, "Frame %s is not in %s, which has %ld frames.\n",
+            label, golden->path, (long)(golden->frames - 1));
+    return false;
+  }
+  bool differs[LYS_GOLDEN_GRID*LYS_GOLDEN_GRID];
+  int num_differing = 0;
+  for (int i = 0; i < LYS_GOLDEN_GRID*LYS_GOLDEN_GRID; i++) {
+    uint64_t recorded = 0;
+    if (fscanf(golden->file, "%" SCNx64, &recorded) != 1) {
+      fprintf(stderr, "%s: malformed line for frame %s.\n", golden->path, recorded_label);
+      return false;
+    }
+    differs[i] = recorded != hashes[i];
+    num_differing += differs[i];
+  }
+
+  if (strcmp(label, recorded_label) != 0) {
+    fprintf(stderr, "Frame %s was recorded as %s in %s.\n", label, recorded_label, golden->path);
+    return false;
+  }
+  if (recorded_width != width || recorded_height != height) {
+    fprintf(stderr, "Frame %s is %dx%d, but was %dx%d in %s.\n",
+            label, width, height, recorded_width, recorded_height, golden->path);
+    return false;
+  }
+  if (num_differing > 0) {
+    fprintf(stderr, "Frame %s differs from %s in %d of %d regions.\n",
+            label, golden->path, num_differing, LYS_GOLDEN_GRID*LYS_GOLDEN_GRID);
+    golden_diff(golden, differs, pixels, height, width);
+    return false;
+  }
+  return true;
+}
+
+bool lys_golden_frame(struct lys_golden *golden, const char *label,
+                      const uint32_t *pixels, int height, int width) {
+  assert(!golden->failed);
+  uint64_t hashes[LYS_GOLDEN_GRID*LYS_GOLDEN_GRID];
+  golden_hash(pixels, height, width, hashes);
+  golden->frames++;
+
+  if (golden->verify) {
+    golden->failed = !golden_check(golden, label, hashes, pixels, height, width);
+    return !golden->failed;
+  }
+
+  fprintf(golden->file, "%s %dx%d", label, width, height);
+  for (int i = 0; i < LYS_GOLDEN_GRID*LYS_GOLDEN_GRID; i++) {
+    fprintf(golden->file, " %016" PRIx64, hashes[i]);
+  }
+  fputc('\n', golden->file);
+  return true;
+}
+
+void lys_golden_close(struct lys_golden *golden) {
+  char c;
+  if (golden->verify && !golden->failed && fscanf(golden->file, " %c", &c) == 1) {
+    fprintf(stderr, "Warning: %s has more than the %ld frames checked.\n",
+            golden->path, (long)golden->frames);
+  }
+  fclose(golden->file);
+}
+
+void* lys_buffer_reserve(struct lys_buffer *buf, size_t size) {
+  if (size <= buf->capacity) {
+    return buf->data;
+  }
+  size_t capacity = buf->capacity + buf->capacity/2;
+  if (capacity < size) {
+    capacity = size;
+  }
+  lys_buffer_free(buf);
+
+  if (capacity >= LYS_HUGE_PAGE_SIZE) {
+    // Map an extra huge page so the start can be aligned, then unmap
+    // the slack on both sides.
+    capacity = (capacity + LYS_HUGE_PAGE_SIZE - 1) & ~(size_t)(LYS_HUGE_PAGE_SIZE - 1);
+    size_t len = capacity + LYS_HUGE_PAGE_SIZE;
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED);
+    char *aligned = (char*)(((uintptr_t)p + LYS_HUGE_PAGE_SIZE - 1)
+                            & ~(uintptr_t)(LYS_HUGE_PAGE_SIZE - 1));
+    if (aligned > p) {
+      munmap(p, aligned - p);
+    }
+    munmap(aligned + capacity, p + len - (aligned + capacity));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, capacity, MADV_HUGEPAGE);
+#endif
+    buf->data = aligned;
+    buf->mapped = true;
+  } else {
+    assert(posix_memalign(&buf->data, 64, capacity) == 0);
+    buf->mapped = false;
+  }
+  host_bytes += capacity;
+  if (host_bytes > host_peak) {
+    host_peak = host_bytes;
+  }
+  // Touch the pages now, so that they are placed on the NUMA node of
+  // the (frontend) thread that uses them rather than whichever thread
+  // first writes a frame.
+  memset(buf->data, 0, capacity);
+  buf->capacity = capacity;
+  return buf->data;
+}
+
+void lys_buffer_free(struct lys_buffer *buf) {
+  host_bytes -= buf->capacity;
+  if (buf->mapped) {
+    munmap(buf->data, buf->capacity);
+  } else {
+    free(buf->data);
+  }
+  buf->data = NULL;
+  buf->capacity = 0;
+  buf->mapped = false;
+}
+
+void lys_resize_request(struct lys_resize *resize, int width, int height) {
+  resize->pending = true;
+  resize->width = width;
+  resize->height = height;
+  resize->time = lys_wall_time();
+}
+
+bool lys_resize_settled(struct lys_resize *resize, int *width, int *height) {
+  if (!resize->pending || lys_wall_time() - resize->time < LYS_RESIZE_SETTLE_US) {
+    return false;
+  }
+  resize->pending = false;
+  *width = resize->width;
+  *height = resize->height;
+  return true;
+}
+
+static void apply_input(struct futhark_context *fut, struct futhark_opaque_state **state,
+                        const struct lys_input *input) {
+  struct futhark_opaque_state *new_state;
+  int64_t start = lys_wall_time();
+  switch (input->kind) {
+  case LYS_INPUT_KEY:
+    FUT_CHECK(fut, futhark_entry_key(fut, &new_state, input->a, input->b, *state));
+    lys_metrics_entry(LYS_ENTRY_KEY, start);
+    break;
+  case LYS_INPUT_MOUSE:
+  case LYS_INPUT_MOTION:
+    FUT_CHECK(fut, futhark_entry_mouse(fut, &new_state, input->a, input->b, input->c, *state));
+    lys_metrics_entry(LYS_ENTRY_MOUSE, start);
+    break;
+  case LYS_INPUT_WHEEL:
+    FUT_CHECK(fut, futhark_entry_wheel(fut, &new_state, input->a, input->b, *state));
+    lys_metrics_entry(LYS_ENTRY_WHEEL, start);
+    break;
+  default:
+    return;
+  }
+  lys_state_created();
+  lys_free_state(fut, *state);
+  *state = new_state;
+}
+
+static void release_frame(struct lys_frame_job *job) {
+  if (job->frame_arr != NULL) {
+    FUT_CHECK(job->fut, futhark_free_u32_2d(job->fut, job->frame_arr));
+    job->frame_arr = NULL;
+  }
+}
+
+#ifdef LYS_DEVICE_TEXT
+static void upload_atlas(struct lys_frame_job *job) {
+  job->atlas = futhark_new_u8_3d(job->fut, lys_font_atlas, LYS_FONT_ATLAS_GLYPHS,
+                                 LYS_FONT_ATLAS_HEIGHT, LYS_FONT_ATLAS_WIDTH);
+  assert(job->atlas != NULL);
+}
+
+// The glyphs are scaled by whole pixels to about the size that the SDL
+// frontend picks for its font.
+static int text_scale(int height, int width) {
+  int size = (height < width ? height : width) / 45;
+  size = size < 14 ? 14 : size > 32 ? 32 : size;
+  int scale = (size + LYS_FONT_ATLAS_HEIGHT / 2) / LYS_FONT_ATLAS_HEIGHT;
+  return scale < 1 ? 1 : scale;
+}
+
+// The glyph number of the UTF-8 character starting with 'c', which is
+// not a continuation byte.  Characters outside the atlas become '?'.
+static uint8_t glyph_number(unsigned char c) {
+  if (c < LYS_FONT_ATLAS_FIRST || c >= LYS_FONT_ATLAS_FIRST + LYS_FONT_ATLAS_GLYPHS) {
+    c = '?';
+  }
+  return c - LYS_FONT_ATLAS_FIRST + 1;
+}
+
+void lys_frame_job_set_text(struct lys_frame_job *job, const char *text,
+                            uint32_t colour, int height, int width) {
+  assert(!job->in_flight);
+  int scale = text_scale(height, width);
+
+  // Most frames have the same overlay as the last one, so only lay it
+  // out when something has changed.  FNV-1a.
+  uint64_t hash = 14695981039346656037u;
+  for (const unsigned char *p = (const unsigned char*) text; *p != '\0'; p++) {
+    hash = (hash ^ *p) * 1099511628211u;
+  }
+  hash = (hash ^ colour) * 1099511628211u;
+  hash = (hash ^ (uint64_t) scale) * 1099511628211u;
+  if (hash == job->text_hash) {
+    return;
+  }
+  job->text_hash = hash;
+  job->text_dirty = true;
+  job->text_colour = colour;
+  job->text_scale = scale;
+
+  int rows = *text != '\0', cols = 0, col = 0;
+  for (const unsigned char *p = (const unsigned char*) text; *p != '\0'; p++) {
+    if (*p == '\n') {
+      rows++;
+      col = 0;
+    } else if ((*p & 0xC0) != 0x80) {
+      col++;
+      cols = col > cols ? col : cols;
+    }
+  }
+  if (cols == 0) {
+    rows = 0;
+  }
+  size_t size = (size_t) rows * cols;
+  if (size > job->text_capacity) {
+    free(job->text);
+    job->text = malloc(size);
+    assert(job->text != NULL);
+    job->text_capacity = size;
+  }
+  memset(job->text, 0, size);
+  job->text_rows = rows;
+  job->text_cols = cols;
+
+  int row = 0;
+  col = 0;
+  for (const unsigned char *p = (const unsigned char*) text; *p != '\0'; p++) {
+    if (*p == '\n') {
+      row++;
+      col = 0;
+    } else if ((*p & 0xC0) != 0x80) {
+      job->text[row * cols + col++] = glyph_number(*p);
+    }
+  }
+}
+#endif
+
+// Render the frame, with the text overlay if there is one.
+static struct futhark_u32_2d* render_frame(struct lys_frame_job *job) {
+  struct futhark_context *fut = job->fut;
+  struct futhark_u32_2d *out_arr;
+#ifdef LYS_DEVICE_TEXT
+  job->text_dirty = false;
+  if (job->text_rows > 0) {
+    struct futhark_u8_2d *text_arr =
+      futhark_new_u8_2d(fut, job->text, job->text_rows, job->text_cols);
+    assert(text_arr != NULL);
+    FUT_CHECK(fut, futhark_entry_render_text(fut, &out_arr, job->atlas, text_arr,
+                                             job->text_colour,
+                                             LYS_TEXT_MARGIN, LYS_TEXT_MARGIN,
+                                             job->text_scale, job->state));
+    FUT_CHECK(fut, futhark_free_u8_2d(fut, text_arr));
+    return out_arr;
+  }
+#endif
+  FUT_CHECK(fut, futhark_entry_render(fut, &out_arr, job->state));
+  return out_arr;
+}
+
+static void run_frame(struct lys_frame_job *job) {
+  struct futhark_context *fut = job->fut;
+
+  // The previous frame has been presented by now.
+  release_frame(job);
+
+  for (int i = 0; i < job->inputs_len; i++) {
+    apply_input(fut, &job->state, &job->inputs[i]);
+  }
+
+  // An idle frame is only computed again to update the overlay, and
+  // must not be stepped.
+  if (!job->idle || job->inputs_len > 0) {
+    struct futhark_opaque_state *new_state;
+    int64_t start = lys_wall_time();
+    FUT_CHECK(fut, futhark_entry_step(fut, &new_state, job->delta, job->state));
+    lys_metrics_entry(LYS_ENTRY_STEP, start);
+    lys_state_created();
+    lys_free_state(fut, job->state);
+    job->state = new_state;
+  }
+
+  int64_t start = lys_wall_time();
+  struct futhark_u32_2d *out_arr = render_frame(job);
+  lys_metrics_entry(LYS_ENTRY_RENDER, start);
+#ifdef LYS_IDLE
+  bool needs_redraw;
+  start = lys_wall_time();
+  FUT_CHECK(fut, futhark_entry_needs_redraw(fut, &needs_redraw, job->state));
+  lys_metrics_entry(LYS_ENTRY_NEEDS_REDRAW, start);
+  job->idle = !needs_redraw;
+#endif
+  start = lys_wall_time();
+#ifdef LYS_HOST_FRAMES
+  if (job->dest == NULL) {
+    // The array is already in host memory, so use it directly.
+    FUT_CHECK(fut, futhark_context_sync(fut));
+    lys_metrics_entry(LYS_ENTRY_VALUES, start);
+    job->frame_arr = out_arr;
+    job->frame = (uint32_t*) futhark_values_raw_u32_2d(fut, out_arr);
+    return;
+  }
+#endif
+  FUT_CHECK(fut, futhark_values_u32_2d(fut, out_arr, job->dest));
+  FUT_CHECK(fut, futhark_context_sync(fut));
+  lys_metrics_entry(LYS_ENTRY_VALUES, start);
+  FUT_CHECK(fut, futhark_free_u32_2d(fut, out_arr));
+  job->frame = job->dest;
+}
+
+static void* frame_job_thread(void *arg) {
+  struct lys_frame_job *job = arg;
+#ifdef __linux__
+  if (placement.worker_cpus != NULL) {
+    pin_thread(&placement.worker);
+  }
+#endif
+  pthread_mutex_lock(&job->lock);
+  while (true) {
+    while (!job->stop && !job->in_flight) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    if (job->stop) {
+      break;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    run_frame(job);
+
+    pthread_mutex_lock(&job->lock);
+    job->in_flight = false;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+static void read_interest(struct lys_frame_job *job) {
+#ifdef LYS_INTEREST
+  FUT_CHECK(job->fut, futhark_entry_interest(job->fut, &job->interest));
+#else
+  job->interest = LYS_EVENT_ALL;
+#endif
+}
+
+void lys_frame_job_init(struct lys_frame_job *job, struct futhark_context *fut) {
+  memset(job, 0, sizeof(struct lys_frame_job));
+  job->fut = fut;
+  read_interest(job);
+#ifdef LYS_DEVICE_TEXT
+  upload_atlas(job);
+#endif
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  assert(pthread_create(&job->thread, NULL, frame_job_thread, job) == 0);
+}
+
+void lys_frame_job_free(struct lys_frame_job *job) {
+  pthread_mutex_lock(&job->lock);
+  assert(!job->in_flight);
+  job->stop = true;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+  pthread_join(job->thread, NULL);
+  release_frame(job);
+#ifdef LYS_DEVICE_TEXT
+  FUT_CHECK(job->fut, futhark_free_u8_3d(job->fut, job->atlas));
+  free(job->text);
+#endif
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  free(job->queue);
+  free(job->inputs);
+}
+
+static int32_t input_event(const struct lys_input *input) {
+  switch (input->kind) {
+  case LYS_INPUT_KEY:
+    return input->a == 0 ? LYS_EVENT_KEYDOWN : LYS_EVENT_KEYUP;
+  case LYS_INPUT_MOUSE:
+  case LYS_INPUT_MOTION:
+    return LYS_EVENT_MOUSE;
+  case LYS_INPUT_WHEEL:
+    return LYS_EVENT_WHEEL;
+  }
+  return 0;
+}
+
+void lys_frame_job_submit(struct lys_frame_job *job, const struct lys_input *input) {
+  if ((job->interest & input_event(input)) == 0) {
+    return;
+  }
+  if (input->kind == LYS_INPUT_MOTION && (job->interest & LYS_EVENT_LATEST_MOTION) &&
+      job->queue_len > 0) {
+    struct lys_input *last = &job->queue[job->queue_len - 1];
+    if (last->kind == LYS_INPUT_MOTION && last->a == input->a) {
+      // Keep the arrival time of the first, for the latency.
+      if (job->relative_motion) {
+        last->b += input->b;
+        last->c += input->c;
+      } else {
+        last->b = input->b;
+        last->c = input->c;
+      }
+      return;
+    }
+  }
+  if (job->queue_len == job->queue_capacity) {
+    job->queue_capacity = job->queue_capacity * 2 + 16;
+    job->queue = realloc(job->queue, job->queue_capacity * sizeof(struct lys_input));
+    assert(job->queue != NULL);
+  }
+  struct lys_input *queued = &job->queue[job->queue_len++];
+  *queued = *input;
+  if (queued->time == 0) {
+    queued->time = lys_wall_time();
+  }
+  if (queued->time > 0 && (job->queue_time == 0 || queued->time < job->queue_time)) {
+    job->queue_time = queued->time;
+  }
+}
+
+bool lys_frame_job_idle(const struct lys_frame_job *job) {
+#ifdef LYS_DEVICE_TEXT
+  if (job->text_dirty) {
+    return false;
+  }
+#endif
+  return job->idle && job->queue_len == 0;
+}
+
+void lys_frame_job_start(struct lys_frame_job *job, struct futhark_opaque_state *state,
+                         float delta, uint32_t *dest) {
+  pthread_mutex_lock(&job->lock);
+  assert(!job->in_flight);
+
+  struct lys_input *tmp = job->inputs;
+  int tmp_capacity = job->inputs_capacity;
+  job->inputs = job->queue;
+  job->inputs_len = job->queue_len;
+  job->inputs_capacity = job->queue_capacity;
+  job->queue = tmp;
+  job->queue_len = 0;
+  job->queue_capacity = tmp_capacity;
+  job->inputs_time = job->queue_time;
+  job->queue_time = 0;
+
+  job->state = state;
+  job->delta = delta;
+#ifndef LYS_HOST_FRAMES
+  assert(dest != NULL);
+#endif
+  job->dest = dest;
+  job->in_flight = true;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+void lys_frame_job_presented(struct lys_frame_job *job, struct lys_latency *latency) {
+  assert(!job->in_flight);
+  if (job->inputs_time != 0) {
+    lys_latency_record(latency, lys_wall_time() - job->inputs_time);
+    job->inputs_time = 0;
+  }
+}
+
+bool lys_frame_job_done(struct lys_frame_job *job) {
+  pthread_mutex_lock(&job->lock);
+  bool done = !job->in_flight;
+  pthread_mutex_unlock(&job->lock);
+  return done;
+}
+
+struct futhark_opaque_state* lys_frame_job_await(struct lys_frame_job *job) {
+  pthread_mutex_lock(&job->lock);
+  while (job->in_flight) {
+    pthread_cond_wait(&job->cond, &job->lock);
+  }
+  struct futhark_opaque_state *state = job->state;
+  job->state = NULL;
+  pthread_mutex_unlock(&job->lock);
+  return state;
+}
+
 #ifdef LYS_TEXT
 size_t n_printf_arguments();
 
@@ -6,17 +6,465 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include PROGHEADER
 
+#ifdef LYS_HOT_RELOAD
+// In hot reload mode (LYS_HOT_RELOAD=1), the Futhark program is not
+// linked in, but loaded from LYS_HOT_RELOAD_LIBRARY, and every
+// function of it that we use is called through this table.
+#if defined(FUTHARK_BACKEND_opencl) || defined(FUTHARK_BACKEND_cuda)
+#define LYS_FUTHARK_DEVICE_FUNCTIONS(X)         \
+  X(futhark_context_config_set_device)
+#else
+#define LYS_FUTHARK_DEVICE_FUNCTIONS(X)
+#endif
+
+#ifdef FUTHARK_BACKEND_opencl
+#define LYS_FUTHARK_OPENCL_FUNCTIONS(X)                 \
+  X(futhark_context_config_select_device_interactively) \
+  X(futhark_context_get_command_queue)
+#else
+#define LYS_FUTHARK_OPENCL_FUNCTIONS(X)
+#endif
+
+#ifdef FUTHARK_BACKEND_multicore
+#define LYS_FUTHARK_MULTICORE_FUNCTIONS(X)      \
+  X(futhark_context_config_set_num_threads)
+#else
+#define LYS_FUTHARK_MULTICORE_FUNCTIONS(X)
+#endif
+
+#ifdef LYS_IDLE
+#define LYS_FUTHARK_IDLE_FUNCTIONS(X)           \
+  X(futhark_entry_needs_redraw)
+#else
+#define LYS_FUTHARK_IDLE_FUNCTIONS(X)
+#endif
+
+#ifdef LYS_INTEREST
+#define LYS_FUTHARK_INTEREST_FUNCTIONS(X)       \
+  X(futhark_entry_interest)
+#else
+#define LYS_FUTHARK_INTEREST_FUNCTIONS(X)
+#endif
+
+#ifdef LYS_DEVICE_TEXT
+#define LYS_FUTHARK_DEVICE_TEXT_FUNCTIONS(X)    \
+  X(futhark_entry_render_text)                  \
+  X(futhark_new_u8_2d)                          \
+  X(futhark_free_u8_2d)                         \
+  X(futhark_new_u8_3d)                          \
+  X(futhark_free_u8_3d)
+#else
+#define LYS_FUTHARK_DEVICE_TEXT_FUNCTIONS(X)
+#endif
+
+#define LYS_FUTHARK_FUNCTIONS(X)                \
+  X(futhark_context_config_new)                 \
+  X(futhark_context_config_free)                \
+  X(futhark_context_config_set_profiling)       \
+  X(futhark_context_config_set_cache_file)      \
+  X(futhark_context_new)                        \
+  X(futhark_context_free)                       \
+  X(futhark_context_get_error)                  \
+  X(futhark_context_sync)                       \
+  X(futhark_context_report)                     \
+  X(futhark_entry_init)                         \
+  X(futhark_entry_grab_mouse)                   \
+  X(futhark_entry_resize)                       \
+  X(futhark_entry_key)                          \
+  X(futhark_entry_mouse)                        \
+  X(futhark_entry_wheel)                        \
+  X(futhark_entry_step)                         \
+  X(futhark_entry_render)                       \
+  X(futhark_entry_text_colour)                  \
+  X(futhark_entry_text_format)                  \
+  X(futhark_entry_text_content)                 \
+  X(futhark_free_opaque_state)                  \
+  X(futhark_store_opaque_state)                 \
+  X(futhark_restore_opaque_state)               \
+  X(futhark_free_u32_2d)                        \
+  X(futhark_values_u32_2d)                      \
+  X(futhark_values_raw_u32_2d)                  \
+  X(futhark_free_u8_1d)                         \
+  X(futhark_values_u8_1d)                       \
+  X(futhark_shape_u8_1d)                        \
+  LYS_FUTHARK_DEVICE_FUNCTIONS(X)               \
+  LYS_FUTHARK_OPENCL_FUNCTIONS(X)               \
+  LYS_FUTHARK_MULTICORE_FUNCTIONS(X)             \
+  LYS_FUTHARK_IDLE_FUNCTIONS(X)                 \
+  LYS_FUTHARK_INTEREST_FUNCTIONS(X)             \
+  LYS_FUTHARK_DEVICE_TEXT_FUNCTIONS(X)
+
+#define LYS_FUTHARK_INDEX(f) LYS_##f,
+enum { LYS_FUTHARK_FUNCTIONS(LYS_FUTHARK_INDEX) LYS_FUTHARK_NUM_FUNCTIONS };
+
+typedef void (*lys_function)(void);
+extern lys_function lys_futhark_functions[LYS_FUTHARK_NUM_FUNCTIONS];
+
+// A name used inside its own macro definition is not expanded again,
+// so the __typeof__ refers to the declaration in PROGHEADER.
+#define futhark_context_config_new (*(__typeof__(&futhark_context_config_new))lys_futhark_functions[LYS_futhark_context_config_new])
+#define futhark_context_config_free (*(__typeof__(&futhark_context_config_free))lys_futhark_functions[LYS_futhark_context_config_free])
+#define futhark_context_config_set_profiling (*(__typeof__(&futhark_context_config_set_profiling))lys_futhark_functions[LYS_futhark_context_config_set_profiling])
+#define futhark_context_config_set_cache_file (*(__typeof__(&futhark_context_config_set_cache_file))lys_futhark_functions[LYS_futhark_context_config_set_cache_file])
+#define futhark_context_new (*(__typeof__(&futhark_context_new))lys_futhark_functions[LYS_futhark_context_new])
+#define futhark_context_free (*(__typeof__(&futhark_context_free))lys_futhark_functions[LYS_futhark_context_free])
+#define futhark_context_get_error (*(__typeof__(&futhark_context_get_error))lys_futhark_functions[LYS_futhark_context_get_error])
+#define futhark_context_sync (*(__typeof__(&futhark_context_sync))lys_futhark_functions[LYS_futhark_context_sync])
+#define futhark_context_report (*(__typeof__(&futhark_context_report))lys_futhark_functions[LYS_futhark_context_report])
+#define futhark_entry_init (*(__typeof__(&futhark_entry_init))lys_futhark_functions[LYS_futhark_entry_init])
+#define futhark_entry_grab_mouse (*(__typeof__(&futhark_entry_grab_mouse))lys_futhark_functions[LYS_futhark_entry_grab_mouse])
+#define futhark_entry_resize (*(__typeof__(&futhark_entry_resize))lys_futhark_functions[LYS_futhark_entry_resize])
+#define futhark_entry_key (*(__typeof__(&futhark_entry_key))lys_futhark_functions[LYS_futhark_entry_key])
+#define futhark_entry_mouse (*(__typeof__(&futhark_entry_mouse))lys_futhark_functions[LYS_futhark_entry_mouse])
+#define futhark_entry_wheel (*(__typeof__(&futhark_entry_wheel))lys_futhark_functions[LYS_futhark_entry_wheel])
+#define futhark_entry_step (*(__typeof__(&futhark_entry_step))lys_futhark_functions[LYS_futhark_entry_step])
+#define futhark_entry_render (*(__typeof__(&futhark_entry_render))lys_futhark_functions[LYS_futhark_entry_render])
+#define futhark_entry_text_colour (*(__typeof__(&futhark_entry_text_colour))lys_futhark_functions[LYS_futhark_entry_text_colour])
+#define futhark_entry_text_format (*(__typeof__(&futhark_entry_text_format))lys_futhark_functions[LYS_futhark_entry_text_format])
+#define futhark_entry_text_content (*(__typeof__(&futhark_entry_text_content))lys_futhark_functions[LYS_futhark_entry_text_content])
+#define futhark_free_opaque_state (*(__typeof__(&futhark_free_opaque_state))lys_futhark_functions[LYS_futhark_free_opaque_state])
+#define futhark_store_opaque_state (*(__typeof__(&futhark_store_opaque_state))lys_futhark_functions[LYS_futhark_store_opaque_state])
+#define futhark_restore_opaque_state (*(__typeof__(&futhark_restore_opaque_state))lys_futhark_functions[LYS_futhark_restore_opaque_state])
+#define futhark_free_u32_2d (*(__typeof__(&futhark_free_u32_2d))lys_futhark_functions[LYS_futhark_free_u32_2d])
+#define futhark_values_u32_2d (*(__typeof__(&futhark_values_u32_2d))lys_futhark_functions[LYS_futhark_values_u32_2d])
+#define futhark_values_raw_u32_2d (*(__typeof__(&futhark_values_raw_u32_2d))lys_futhark_functions[LYS_futhark_values_raw_u32_2d])
+#define futhark_free_u8_1d (*(__typeof__(&futhark_free_u8_1d))lys_futhark_functions[LYS_futhark_free_u8_1d])
+#define futhark_values_u8_1d (*(__typeof__(&futhark_values_u8_1d))lys_futhark_functions[LYS_futhark_values_u8_1d])
+#define futhark_shape_u8_1d (*(__typeof__(&futhark_shape_u8_1d))lys_futhark_functions[LYS_futhark_shape_u8_1d])
+#if defined(FUTHARK_BACKEND_opencl) || defined(FUTHARK_BACKEND_cuda)
+#define futhark_context_config_set_device (*(__typeof__(&futhark_context_config_set_device))lys_futhark_functions[LYS_futhark_context_config_set_device])
+#endif
+#ifdef FUTHARK_BACKEND_multicore
+#define futhark_context_config_set_num_threads (*(__typeof__(&futhark_context_config_set_num_threads))lys_futhark_functions[LYS_futhark_context_config_set_num_threads])
+#endif
+#ifdef LYS_IDLE
+#define futhark_entry_needs_redraw (*(__typeof__(&futhark_entry_needs_redraw))lys_futhark_functions[LYS_futhark_entry_needs_redraw])
+#endif
+#ifdef LYS_INTEREST
+#define futhark_entry_interest (*(__typeof__(&futhark_entry_interest))lys_futhark_functions[LYS_futhark_entry_interest])
+#endif
+#ifdef LYS_DEVICE_TEXT
+#define futhark_entry_render_text (*(__typeof__(&futhark_entry_render_text))lys_futhark_functions[LYS_futhark_entry_render_text])
+#define futhark_new_u8_2d (*(__typeof__(&futhark_new_u8_2d))lys_futhark_functions[LYS_futhark_new_u8_2d])
+#define futhark_free_u8_2d (*(__typeof__(&futhark_free_u8_2d))lys_futhark_functions[LYS_futhark_free_u8_2d])
+#define futhark_new_u8_3d (*(__typeof__(&futhark_new_u8_3d))lys_futhark_functions[LYS_futhark_new_u8_3d])
+#define futhark_free_u8_3d (*(__typeof__(&futhark_free_u8_3d))lys_futhark_functions[LYS_futhark_free_u8_3d])
+#endif
+#ifdef FUTHARK_BACKEND_opencl
+#define futhark_context_config_select_device_interactively (*(__typeof__(&futhark_context_config_select_device_interactively))lys_futhark_functions[LYS_futhark_context_config_select_device_interactively])
+#define futhark_context_get_command_queue (*(__typeof__(&futhark_context_get_command_queue))lys_futhark_functions[LYS_futhark_context_get_command_queue])
+#endif
+
+// How often to check whether the library has been rebuilt.
+#define LYS_HOT_RELOAD_INTERVAL_US 250000
+
+// The output types of text_content, generated by gen_printf.py into
+// both the executable and the library.
+extern const char lys_text_content_signature[];
+
+#endif
+
+// If 'profiling' is true, the context records the execution of every
+// kernel for lys_profile.
 void lys_setup_futhark_context(const char *progname,
                                const char *deviceopt, bool device_interactive,
+                               bool profiling,
                                struct futhark_context_config* *futcfg,
                                struct futhark_context* *futctx,
                                char* *opencl_device_name);
 
 int64_t lys_wall_time();
 
+// Input-to-display latencies, in microseconds, of the most recent
+// frames that consumed input.  A frame's latency is that of the oldest
+// input it consumed.
+#define LYS_LATENCY_SAMPLES 256
+struct lys_latency {
+  int64_t samples[LYS_LATENCY_SAMPLES];
+  int num_samples;
+  int next;
+};
+
+void lys_latency_record(struct lys_latency *latency, int64_t usecs);
+
+// Returns the p'th percentile (0 to 100) of the recorded latencies, or
+// -1 if none have been recorded.
+int64_t lys_latency_percentile(const struct lys_latency *latency, double p);
+
+// Host memory for frame buffers.  It only ever grows, and by at least
+// half its size at a time, so resizing a window back and forth does not
+// reallocate.  Buffers are 64-byte aligned; those of at least
+// LYS_HUGE_PAGE_SIZE are mapped directly, aligned to and advised to
+// use huge pages.
+#define LYS_HUGE_PAGE_SIZE (2*1024*1024)
+struct lys_buffer {
+  void *data;
+  size_t capacity;
+  bool mapped;
+};
+
+// Returns room for at least 'size' bytes.  The contents are lost if
+// the buffer has to grow.
+void* lys_buffer_reserve(struct lys_buffer *buf, size_t size);
+
+void lys_buffer_free(struct lys_buffer *buf);
+
+// Resize requests are debounced: a new size is only passed on to the
+// program once it has been left alone for LYS_RESIZE_SETTLE_US, so
+// dragging a window edge does not resize the state on every event.
+#define LYS_RESIZE_SETTLE_US 50000
+struct lys_resize {
+  bool pending;
+  int width;
+  int height;
+  int64_t time;
+};
+
+void lys_resize_request(struct lys_resize *resize, int width, int height);
+
+// If a requested size has settled, store it in 'width' and 'height'
+// and return true.
+bool lys_resize_settled(struct lys_resize *resize, int *width, int *height);
+
+// Opaque states are counted as they are created and freed, so that a
+// chain of replacements that leaks them shows up in struct lys_memory.
+// Call lys_state_created() for every new state, and free states with
+// lys_free_state().  The entry points that return a new state consume
+// the old one (see genlys.fut), which must then be freed without being
+// passed to any other entry point.
+void lys_state_created(void);
+void lys_free_state(struct futhark_context *fut, struct futhark_opaque_state *state);
+
+// Remove a Unix socket left at 'path' by an earlier run, before binding
+// a new one there.  Anything else at 'path' is left alone: returns
+// false, after printing why, if 'path' exists and is not a socket.
+bool lys_remove_stale_socket(const char *path);
+
+// Thread placement (the -a and -A options).  The lists are of CPUs,
+// such as "0-7,16", or NULL to leave threads where they are.  The
+// calling (frontend) thread is pinned to 'frontend_cpus' right away,
+// so the frame buffers it allocates are first touched on its NUMA
+// node.  The threads running Futhark code are pinned to 'worker_cpus':
+// the frame job threads, and with the multicore backend the worker
+// threads of contexts created afterwards.  Returns false if a list is
+// invalid or pinning is not supported.
+bool lys_set_placement(const char *frontend_cpus, const char *worker_cpus);
+
+// Frame time jitter and where the frontend thread runs, for the F2
+// overlay and benchmark results.
+struct lys_frame_stats {
+  int64_t last;
+  double mean_ms;
+  double jitter_ms;
+  int cpu;
+  int node;
+  int64_t migrations;
+  int64_t node_changes;
+};
+
+void lys_frame_stats_init(struct lys_frame_stats *stats);
+
+// Call once per frame, from the frontend thread.
+void lys_frame_stats_frame(struct lys_frame_stats *stats);
+
+// Live per-kernel profiling (the -P option).  Every
+// LYS_PROFILE_INTERVAL_US the profiling report of the context is
+// collected, and the kernels that took the most time since the last
+// collection are summarised for the F2 overlay.  Totals for the whole
+// run are kept for lys_profile_write().
+#define LYS_PROFILE_INTERVAL_US 500000
+#define LYS_PROFILE_MAX_KERNELS 256
+#define LYS_PROFILE_SUMMARY_SIZE 2048
+
+struct lys_profile_kernel {
+  char *name;
+  int64_t calls;
+  double total_us;
+  double window_us;
+};
+
+struct lys_profile {
+  struct lys_profile_kernel kernels[LYS_PROFILE_MAX_KERNELS];
+  int num_kernels;
+  int64_t start;
+  int64_t window_start;
+  int64_t frames;
+  int64_t window_frames;
+  char summary[LYS_PROFILE_SUMMARY_SIZE];
+};
+
+void lys_profile_init(struct lys_profile *profile);
+
+// Call once per frame, while no frame is in flight.
+void lys_profile_frame(struct lys_profile *profile, struct futhark_context *fut);
+
+// Collect the remaining events and write a report for the whole run to
+// 'path'.  Returns 0 on success.
+int lys_profile_write(struct lys_profile *profile, struct futhark_context *fut,
+                      const char *path);
+
+void lys_profile_free(struct lys_profile *profile);
+
+// Memory use, for the F2 overlay, the -B results and the budget (-M).
+// Futhark only reports the peak use of a context in each memory space;
+// the host figures are of all struct lys_buffer frame buffers.
+struct lys_memory {
+  int64_t budget; // Bytes of context peak and host memory, or 0.
+  int64_t context_peak;
+  int64_t host;
+  int64_t host_peak;
+  int64_t states;
+  int64_t states_peak;
+  // The peak of each space, for diagnostics.
+  char spaces[256];
+  int64_t last_sample;
+};
+
+void lys_memory_init(struct lys_memory *memory, int64_t budget);
+
+// Sample the memory use, while no frame is in flight.  This takes a
+// report from the context, which consumes its profiling events; they
+// are added to 'profile' if it is not NULL.  Returns false, after
+// printing what uses the memory, if the budget is exceeded.
+bool lys_memory_sample(struct lys_memory *memory, struct futhark_context *fut,
+                       struct lys_profile *profile);
+
+// Call once per frame.  Taking and parsing a report is too slow to do
+// every frame, so this only calls lys_memory_sample() every
+// LYS_MEMORY_INTERVAL_US, and otherwise returns true.
+#define LYS_MEMORY_INTERVAL_US 1000000
+bool lys_memory_frame(struct lys_memory *memory, struct futhark_context *fut,
+                      struct lys_profile *profile);
+
+// Counters for the metrics endpoint (see metrics.h).  They are updated
+// with relaxed atomic operations by the frame loop and the frame job,
+// so neither ever waits for the thread that serves them.
+enum lys_entry {
+  LYS_ENTRY_KEY,
+  LYS_ENTRY_MOUSE,
+  LYS_ENTRY_WHEEL,
+  LYS_ENTRY_STEP,
+  LYS_ENTRY_RENDER,
+  LYS_ENTRY_NEEDS_REDRAW,
+  LYS_ENTRY_RESIZE,
+  // Copying the frame to the host, which waits for the device.
+  LYS_ENTRY_VALUES,
+  LYS_NUM_ENTRIES
+};
+
+extern const char *lys_entry_names[LYS_NUM_ENTRIES];
+
+// Upper bounds of the frame time histogram buckets, in microseconds.
+// There is one more bucket, for longer frames.
+#define LYS_METRICS_BUCKETS 10
+extern const int64_t lys_metrics_bucket_us[LYS_METRICS_BUCKETS];
+
+struct lys_metrics {
+  _Atomic int64_t frames;
+  // Frames due at the target rate that were never shown, not counting
+  // time spent idle.
+  _Atomic int64_t dropped_frames;
+  _Atomic int64_t frame_buckets[LYS_METRICS_BUCKETS+1];
+  _Atomic int64_t frame_us;
+  _Atomic int64_t entry_calls[LYS_NUM_ENTRIES];
+  _Atomic int64_t entry_us[LYS_NUM_ENTRIES];
+  // As of the last lys_memory_sample().
+  _Atomic int64_t context_peak;
+  _Atomic int64_t host;
+  _Atomic int64_t states;
+
+  // Used only by the frontend thread.
+  int64_t target_us;
+  int64_t last;
+  bool last_idle;
+};
+
+extern struct lys_metrics lys_metrics;
+
+// Set the frame rate the frontend aims for, against which frames are
+// counted as dropped.
+void lys_metrics_init(int max_fps);
+
+// Call once per frame, from the frontend thread.  'idle' is whether
+// the frame was left unchanged (LYS_IDLE), so the wait for the next one
+// is not a drop.
+void lys_metrics_frame(bool idle);
+
+// Count a call of an entry point that started at 'start', from
+// lys_wall_time().
+void lys_metrics_entry(enum lys_entry entry, int64_t start);
+
+// Frame times recorded for benchmarking (the -B option).
+struct lys_bench {
+  int64_t start;
+  int64_t last;
+  int64_t *frame_times;
+  int num_frames;
+  int capacity;
+};
+
+void lys_bench_init(struct lys_bench *bench);
+
+// Call once per frame.
+void lys_bench_frame(struct lys_bench *bench);
+
+// Write a JSON summary of the frame times to 'path'.  The first tenth
+// of the frames are considered warmup and left out.  Returns 0 on
+// success.
+int lys_bench_write(const struct lys_bench *bench, const char *path, const char *program,
+                    const struct lys_frame_stats *stats,
+                    const struct lys_latency *latency,
+                    const struct lys_memory *memory);
+
+void lys_bench_free(struct lys_bench *bench);
+
+// Golden frame hashes (the -H and -V options), for checking that an
+// optimisation does not change what is rendered.  Each frame is split
+// into LYS_GOLDEN_GRID by LYS_GOLDEN_GRID regions, and every region is
+// hashed with a fast non-cryptographic hash.  Recording writes a line
+// per frame to the file; verifying compares against such a file, and
+// at the first frame that differs reports it and writes the frame to
+// PATH.diff.ppm, with the regions that differ in full colour and the
+// rest dimmed.  The hashes only match for the same seed, timestep,
+// size and backend.
+#define LYS_GOLDEN_GRID 8
+
+struct lys_golden {
+  FILE *file;
+  const char *path;
+  bool verify;
+  int64_t frames;
+  bool failed;
+};
+
+// Returns false, after printing why, if 'path' cannot be opened.
+bool lys_golden_open(struct lys_golden *golden, const char *path, bool verify);
+
+// Record or check a frame, which is named by 'label' in the file.
+// Returns false, and sets 'failed', if it differs from the recorded
+// frame.
+bool lys_golden_frame(struct lys_golden *golden, const char *label,
+                      const uint32_t *pixels, int height, int width);
+
+// Warns if fewer frames were checked than were recorded.
+void lys_golden_close(struct lys_golden *golden);
+
+// Size of the buffer for the statistics overlay shown with F2.
+#define LYS_STATS_BUFFER_SIZE 4096
+
+// Write 'text' (which may be empty) followed by the frame statistics
+// and, if 'profile' is not NULL, its summary to 'out'.
+void lys_build_stats(char *out, size_t len, const char *text,
+                     const struct lys_frame_stats *stats,
+                     const struct lys_latency *latency,
+                     const struct lys_memory *memory,
+                     const struct lys_profile *profile);
+
 #define FUT_CHECK(ctx, x) _fut_check(ctx, x, __FILE__, __LINE__)
 static inline void _fut_check(struct futhark_context *ctx, int res,
                               const char *file, int line) {
@@ -27,6 +475,155 @@ static inline void _fut_check(struct futhark_context *ctx, int res,
   }
 }
 
+// Input events destined for the Futhark program.  They are queued
+// and applied just before the next step, so they can be submitted
+// while a frame is being computed.
+enum lys_input_kind {
+  LYS_INPUT_KEY,    // a: 0 for keydown, 1 for keyup.  b: SDL keycode.
+  LYS_INPUT_MOUSE,  // a: button mask.  b, c: x, y.
+  LYS_INPUT_WHEEL,  // a, b: dx, dy.
+  LYS_INPUT_MOTION  // As LYS_INPUT_MOUSE, but may be merged (see below).
+};
+
+// The kinds of events the program handles, as in the 'events' module
+// of lys.fut.  With LYS_INTEREST they are read from the program, and
+// inputs of other kinds are dropped when submitted.  With
+// LYS_EVENT_LATEST_MOTION, a LYS_INPUT_MOTION submitted right after
+// another with the same buttons replaces it.
+#define LYS_EVENT_KEYDOWN 1
+#define LYS_EVENT_KEYUP 2
+#define LYS_EVENT_MOUSE 4
+#define LYS_EVENT_WHEEL 8
+#define LYS_EVENT_LATEST_MOTION 16
+#define LYS_EVENT_ALL (LYS_EVENT_KEYDOWN | LYS_EVENT_KEYUP | LYS_EVENT_MOUSE | LYS_EVENT_WHEEL)
+
+struct lys_input {
+  enum lys_input_kind kind;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+  // When the input arrived, from lys_wall_time(), or 0 for when it is
+  // submitted.  Negative if it should not count towards the latency.
+  int64_t time;
+};
+
+// Computes frames on a background thread: applies the queued inputs,
+// steps, renders, and copies the pixels to host memory.  While a
+// frame is in flight the job owns the state, and nothing else may use
+// the Futhark context.
+struct lys_frame_job {
+  struct futhark_context *fut;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool in_flight;
+  bool stop;
+
+  struct futhark_opaque_state *state;
+  float delta;
+  uint32_t *dest;
+
+  // The pixels of the last finished frame.  With LYS_HOST_FRAMES and
+  // no 'dest', this points into 'frame_arr' itself, which is kept
+  // until the next frame starts.
+  uint32_t *frame;
+  struct futhark_u32_2d *frame_arr;
+
+  // With LYS_IDLE, set when the program has said that the last frame
+  // will not change until the next input or resize.
+  bool idle;
+
+  // 'queue' is filled by the submitting thread; 'inputs' is what the
+  // job in flight applies.
+  struct lys_input *queue;
+  int queue_len;
+  int queue_capacity;
+  struct lys_input *inputs;
+  int inputs_len;
+  int inputs_capacity;
+
+  // Arrival time of the oldest input in 'queue' and 'inputs', or 0.
+  int64_t queue_time;
+  int64_t inputs_time;
+
+  // LYS_EVENT_* bits of the inputs to keep.  If 'relative_motion',
+  // merged motion adds up the positions instead of keeping the last.
+  int32_t interest;
+  bool relative_motion;
+
+#ifdef LYS_DEVICE_TEXT
+  // The glyph atlas, uploaded to the context once, and the overlay
+  // composited into the following frames: 'text_rows' lines of
+  // 'text_cols' glyph numbers (see gentext.fut).  'text_dirty' is set
+  // when the overlay has changed, so that an idle frame is rendered
+  // again, but not stepped.
+  struct futhark_u8_3d *atlas;
+  uint8_t *text;
+  int text_rows;
+  int text_cols;
+  size_t text_capacity;
+  uint32_t text_colour;
+  int text_scale;
+  uint64_t text_hash;
+  bool text_dirty;
+#endif
+};
+
+void lys_frame_job_init(struct lys_frame_job *job, struct futhark_context *fut);
+
+void lys_frame_job_free(struct lys_frame_job *job);
+
+void lys_frame_job_submit(struct lys_frame_job *job, const struct lys_input *input);
+
+// True if the next frame would be the same as the last one: the job is
+// idle and no input has been submitted since (nor, with
+// LYS_DEVICE_TEXT, has the overlay changed).  The frontends then
+// present the last frame again instead of starting a new one, and wait
+// for events for at most LYS_IDLE_TIMEOUT_MS.  Always false without
+// LYS_IDLE.
+bool lys_frame_job_idle(const struct lys_frame_job *job);
+
+#define LYS_IDLE_TIMEOUT_MS 100
+
+#ifdef LYS_DEVICE_TEXT
+// Where the overlay starts in the frame, in pixels.
+#define LYS_TEXT_MARGIN 10
+
+// Set the text overlay (which may be empty) that the following frames
+// are composited with on the device, in place of the frontend's
+// draw_text().  The glyphs are scaled to suit a frame of the given
+// size.  Must not be called while a frame is in flight.
+void lys_frame_job_set_text(struct lys_frame_job *job, const char *text,
+                            uint32_t colour, int height, int width);
+#endif
+
+// Start computing the next frame from 'state', which the job takes
+// ownership of.  The pixels are written to 'dest'.  With CPU backends
+// (LYS_HOST_FRAMES), 'dest' may be NULL to avoid copying the frame, in
+// which case it must be read through 'frame' before the next start.
+void lys_frame_job_start(struct lys_frame_job *job, struct futhark_opaque_state *state,
+                         float delta, uint32_t *dest);
+
+bool lys_frame_job_done(struct lys_frame_job *job);
+
+// Call when the last frame has been presented, to record the latency
+// of the inputs it consumed.  Presenting it again records nothing.
+void lys_frame_job_presented(struct lys_frame_job *job, struct lys_latency *latency);
+
+// Wait for the frame to finish and return the new state.
+struct futhark_opaque_state* lys_frame_job_await(struct lys_frame_job *job);
+
+#ifdef LYS_HOT_RELOAD
+// If the library has been rebuilt, replace the program, context and
+// configuration set up by lys_setup_futhark_context() with new ones,
+// and point 'job' at the new context.  The state is carried over if
+// the new program can restore it, and otherwise initialised anew at
+// the given size.  Must not be called while a frame is in flight.
+// Returns true if the program was reloaded.
+bool lys_hot_reload(struct lys_frame_job *job, struct futhark_opaque_state **state,
+                    int height, int width);
+#endif
+
 #ifdef LYS_TEXT
 struct lys_text {
   char* text_format;
@@ -0,0 +1,259 @@
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define PAGE_ALIGN(x) (((x) + 4095) & ~(size_t)4095)
+
+static int64_t wall_time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+  (void)addr;
+#endif
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val, int timeout_ms) {
+#ifdef __linux__
+  struct timespec ts = { .tv_sec = timeout_ms / 1000,
+                         .tv_nsec = (timeout_ms % 1000) * 1000000L };
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+  (void)addr; (void)val; (void)timeout_ms;
+  usleep(1000);
+#endif
+}
+
+struct lys_shm* lys_shm_create(const char *name, int num_slots) {
+  if (num_slots < 2 || num_slots > LYS_SHM_MAX_SLOTS) {
+    fprintf(stderr, "Number of shared memory slots must be between 2 and %d.\n",
+            LYS_SHM_MAX_SLOTS);
+    return NULL;
+  }
+
+  struct lys_shm *shm = calloc(1, sizeof(struct lys_shm));
+  assert(shm != NULL);
+  shm->name = malloc(strlen(name) + 2);
+  assert(shm->name != NULL);
+  sprintf(shm->name, "/%s", name);
+
+  shm_unlink(shm->name);
+  shm->fd = shm_open(shm->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (shm->fd < 0) {
+    fprintf(stderr, "Cannot create shared memory %s: %s\n", shm->name, strerror(errno));
+    free(shm->name);
+    free(shm);
+    return NULL;
+  }
+
+  shm->size = PAGE_ALIGN(sizeof(struct lys_shm_header));
+  if (ftruncate(shm->fd, shm->size) != 0) {
+    fprintf(stderr, "Cannot resize shared memory %s: %s\n", shm->name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  shm->header = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (shm->header == MAP_FAILED) {
+    fprintf(stderr, "Cannot map shared memory %s: %s\n", shm->name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  struct lys_shm_header *h = shm->header;
+  h->magic = LYS_SHM_MAGIC;
+  h->version = LYS_SHM_VERSION;
+  h->num_slots = num_slots;
+  h->data_offset = shm->size;
+  atomic_store(&h->total_size, shm->size);
+  return shm;
+}
+
+struct lys_shm* lys_shm_create_from_option(const char *option) {
+  char name[strlen(option) + 1];
+  strcpy(name, option);
+  int num_slots = 3;
+  char *colon = strchr(name, ':');
+  if (colon != NULL) {
+    *colon = '\0';
+    num_slots = atoi(colon + 1);
+  }
+  return lys_shm_create(name, num_slots);
+}
+
+void lys_shm_free(struct lys_shm *shm) {
+  munmap(shm->header, shm->size);
+  close(shm->fd);
+  shm_unlink(shm->name);
+  free(shm->name);
+  free(shm);
+}
+
+// Grow the object so that every slot can hold 'frame_bytes'.  Existing
+// slots are never shrunk, so going back to a smaller size is free.
+static void ensure_capacity(struct lys_shm *shm, size_t frame_bytes) {
+  struct lys_shm_header *h = shm->header;
+  size_t stride = atomic_load(&h->slot_stride);
+  if (frame_bytes <= stride) {
+    return;
+  }
+  stride = PAGE_ALIGN(frame_bytes);
+  size_t new_size = h->data_offset + stride * h->num_slots;
+
+  if (ftruncate(shm->fd, new_size) != 0) {
+    fprintf(stderr, "Cannot resize shared memory %s: %s\n", shm->name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  void *p = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Cannot map shared memory %s: %s\n", shm->name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  munmap(shm->header, shm->size);
+  shm->header = h = p;
+  shm->size = new_size;
+
+  // The slots have moved, so everything in them is gone.
+  for (uint32_t i = 0; i < h->num_slots; i++) {
+    atomic_store(&h->slots[i].seq, LYS_SHM_WRITING);
+  }
+  atomic_store(&h->slot_stride, stride);
+  atomic_store(&h->total_size, new_size);
+}
+
+uint32_t* lys_shm_begin(struct lys_shm *shm, int width, int height) {
+  struct lys_shm_header *h = shm->header;
+  bool resized = atomic_load(&h->width) != (uint32_t)width ||
+    atomic_load(&h->height) != (uint32_t)height;
+  ensure_capacity(shm, (size_t)width * height * sizeof(uint32_t));
+  h = shm->header;
+  if (resized) {
+    atomic_store(&h->width, width);
+    atomic_store(&h->height, height);
+    atomic_fetch_add(&h->generation, 1);
+  }
+
+  uint64_t seq = ++shm->seq;
+  struct lys_shm_slot *slot = &h->slots[seq % h->num_slots];
+  atomic_store_explicit(&slot->seq, LYS_SHM_WRITING, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->generation = atomic_load(&h->generation);
+  slot->width = width;
+  slot->height = height;
+  shm->frame = (uint32_t*)((char*)h + h->data_offset +
+                           (seq % h->num_slots) * atomic_load(&h->slot_stride));
+  return shm->frame;
+}
+
+void lys_shm_publish(struct lys_shm *shm) {
+  struct lys_shm_header *h = shm->header;
+  struct lys_shm_slot *slot = &h->slots[shm->seq % h->num_slots];
+  slot->timestamp = wall_time_us();
+  atomic_store_explicit(&slot->seq, shm->seq, memory_order_release);
+  atomic_store_explicit(&h->latest_seq, shm->seq, memory_order_release);
+  atomic_fetch_add(&h->futex, 1);
+  futex_wake(&h->futex);
+}
+
+static int reader_map(struct lys_shm_reader *reader, size_t size) {
+  void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, reader->fd, 0);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  if (reader->header != NULL) {
+    munmap(reader->header, reader->size);
+  }
+  reader->header = p;
+  reader->size = size;
+  return 0;
+}
+
+int lys_shm_reader_open(struct lys_shm_reader *reader, const char *name) {
+  memset(reader, 0, sizeof(struct lys_shm_reader));
+  char path[strlen(name) + 2];
+  sprintf(path, "/%s", name);
+  // Readers only need read access, which the object grants to every
+  // user (0644); waiting on the futex works on read-only mappings.
+  reader->fd = shm_open(path, O_RDONLY, 0);
+  if (reader->fd < 0) {
+    return -1;
+  }
+  if (reader_map(reader, PAGE_ALIGN(sizeof(struct lys_shm_header))) != 0 ||
+      reader->header->magic != LYS_SHM_MAGIC ||
+      reader->header->version != LYS_SHM_VERSION) {
+    lys_shm_reader_close(reader);
+    return -1;
+  }
+  return 0;
+}
+
+void lys_shm_reader_close(struct lys_shm_reader *reader) {
+  if (reader->header != NULL) {
+    munmap(reader->header, reader->size);
+  }
+  close(reader->fd);
+  reader->header = NULL;
+}
+
+bool lys_shm_reader_next(struct lys_shm_reader *reader, int timeout_ms,
+                         struct lys_shm_frame *frame) {
+  int64_t deadline = wall_time_us() + (int64_t)timeout_ms * 1000;
+  while (true) {
+    struct lys_shm_header *h = reader->header;
+    uint32_t futex = atomic_load(&h->futex);
+    uint64_t seq = atomic_load_explicit(&h->latest_seq, memory_order_acquire);
+
+    if (seq != 0 && seq != reader->last_seq) {
+      size_t total_size = atomic_load(&h->total_size);
+      if (total_size > reader->size) {
+        if (reader_map(reader, total_size) != 0) {
+          return false;
+        }
+        continue;
+      }
+      struct lys_shm_slot *slot = &h->slots[seq % h->num_slots];
+      if (atomic_load_explicit(&slot->seq, memory_order_acquire) == seq) {
+        frame->seq = seq;
+        frame->generation = slot->generation;
+        frame->width = slot->width;
+        frame->height = slot->height;
+        frame->timestamp = slot->timestamp;
+        frame->pixels = (const uint32_t*)((const char*)h + h->data_offset +
+                                          (seq % h->num_slots) * atomic_load(&h->slot_stride));
+        if (lys_shm_reader_valid(reader, frame)) {
+          reader->last_seq = seq;
+          return true;
+        }
+      }
+    }
+
+    int64_t left = deadline - wall_time_us();
+    if (left <= 0) {
+      return false;
+    }
+    futex_wait(&h->futex, futex, left / 1000 + 1);
+  }
+}
+
+bool lys_shm_reader_valid(const struct lys_shm_reader *reader,
+                          const struct lys_shm_frame *frame) {
+  const struct lys_shm_slot *slot =
+    &reader->header->slots[frame->seq % reader->header->num_slots];
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit((_Atomic uint64_t*)&slot->seq, memory_order_relaxed) == frame->seq;
+}
@@ -0,0 +1,126 @@
+// Export of rendered frames through POSIX shared memory, so that other
+// processes on the same machine (compositors, recorders) can read them
+// without copying.
+//
+// The shared memory object starts with a 'struct lys_shm_header',
+// followed by 'num_slots' frame slots of 'slot_stride' bytes each,
+// starting at 'data_offset'.  Frames are published round-robin: frame
+// number 'seq' lives in slot 'seq % num_slots'.  Each slot has a
+// sequence number that is set to LYS_SHM_WRITING while the slot is
+// being overwritten, so a reader can tell whether the pixels it read
+// are intact by checking that the sequence number is unchanged
+// afterwards.
+//
+// When the frame size changes, the 'generation' is incremented.  If
+// the new frames do not fit in the existing slots, the object is grown
+// and readers must map it again ('total_size' tells how much).
+//
+// Every publication increments 'futex' and wakes any processes waiting
+// on it (Linux only; elsewhere readers must poll 'latest_seq').
+//
+// This header does not depend on the Futhark program, so consumers can
+// use it and shm.c on their own.
+
+#ifndef LIBLYS_SHM
+#define LIBLYS_SHM
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define LYS_SHM_MAGIC 0x4d48534c // "LSHM"
+#define LYS_SHM_VERSION 1
+#define LYS_SHM_MAX_SLOTS 16
+#define LYS_SHM_WRITING UINT64_MAX
+
+struct lys_shm_slot {
+  _Atomic uint64_t seq;
+  uint32_t generation;
+  uint32_t width;
+  uint32_t height;
+  uint32_t padding;
+  // Wall clock time of publication in microseconds since the epoch.
+  int64_t timestamp;
+};
+
+struct lys_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;
+  _Atomic uint32_t generation;
+  _Atomic uint32_t width;
+  _Atomic uint32_t height;
+  _Atomic uint64_t total_size;
+  _Atomic uint64_t slot_stride;
+  uint64_t data_offset;
+  // Sequence number of the most recently published frame, starting
+  // from 1.  Zero means that nothing has been published yet.
+  _Atomic uint64_t latest_seq;
+  _Atomic uint32_t futex;
+  struct lys_shm_slot slots[LYS_SHM_MAX_SLOTS];
+};
+
+struct lys_shm {
+  char *name;
+  int fd;
+  struct lys_shm_header *header;
+  size_t size;
+  uint64_t seq;
+  uint32_t *frame;
+};
+
+// Create (or replace) the shared memory object '/name' with room for
+// 'num_slots' frames.  Returns NULL and prints an error on failure.
+struct lys_shm* lys_shm_create(const char *name, int num_slots);
+
+// Like lys_shm_create(), but takes a command line argument of the form
+// NAME or NAME:SLOTS.
+struct lys_shm* lys_shm_create_from_option(const char *option);
+
+// Remove the shared memory object and free the handle.
+void lys_shm_free(struct lys_shm *shm);
+
+// Returns the buffer in which the next frame of the given size must be
+// written.  The buffer stays valid until the next call.
+uint32_t* lys_shm_begin(struct lys_shm *shm, int width, int height);
+
+// Makes the frame written to the buffer returned by lys_shm_begin()
+// visible to readers and wakes them up.
+void lys_shm_publish(struct lys_shm *shm);
+
+// Reader side.
+struct lys_shm_reader {
+  int fd;
+  struct lys_shm_header *header;
+  size_t size;
+  uint64_t last_seq;
+};
+
+struct lys_shm_frame {
+  uint64_t seq;
+  uint32_t generation;
+  uint32_t width;
+  uint32_t height;
+  int64_t timestamp;
+  const uint32_t *pixels;
+};
+
+// Returns 0 on success.
+int lys_shm_reader_open(struct lys_shm_reader *reader, const char *name);
+
+void lys_shm_reader_close(struct lys_shm_reader *reader);
+
+// Waits up to 'timeout_ms' milliseconds for a frame newer than the
+// last one returned, and fills in 'frame' with the newest frame.  The
+// pixels are read directly from shared memory.  Returns false on
+// timeout.
+bool lys_shm_reader_next(struct lys_shm_reader *reader, int timeout_ms,
+                         struct lys_shm_frame *frame);
+
+// Whether 'frame' has not been overwritten since it was returned by
+// lys_shm_reader_next().  Check this after using the pixels.
+bool lys_shm_reader_valid(const struct lys_shm_reader *reader,
+                          const struct lys_shm_frame *frame);
+
+#endif
@@ -0,0 +1,133 @@
+// Reference reader for frames published in shared memory with -S (see
+// shm.h).  It waits for new frames, copies each out of the ring,
+// checks that the copy is intact, and writes the last intact frame as
+// a PPM image.  It is mostly useful for testing a consumer of a Lys
+// program on the same machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "shm.h"
+
+static void write_ppm(const char *path, const uint32_t *frame, int width, int height) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int i = 0; i < width * height; i++) {
+    fputc((frame[i]>>16)&0xFF, f);
+    fputc((frame[i]>>8)&0xFF, f);
+    fputc((frame[i]>>0)&0xFF, f);
+  }
+  fclose(f);
+}
+
+static void usage(char **argv) {
+  printf("Usage: %s options... NAME\n", argv[0]);
+  puts("Options:");
+  puts("  -?          Print this help and exit.");
+  puts("  -f INT      Number of frames to read (default 60).");
+  puts("  -t MS       Give up after this long without a new frame (default 5000).");
+  puts("  -o FILE     Write the last intact frame to FILE as PPM.");
+}
+
+int main(int argc, char** argv) {
+  int num_frames = 60;
+  int timeout_ms = 5000;
+  const char *output = NULL;
+
+  int c;
+  while ( (c = getopt(argc, argv, "f:t:o:")) != -1) {
+    switch (c) {
+    case 'f':
+      num_frames = atoi(optarg);
+      if (num_frames <= 0) {
+        fprintf(stderr, "'%s' is not a number of frames.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      timeout_ms = atoi(optarg);
+      if (timeout_ms <= 0) {
+        fprintf(stderr, "'%s' is not a valid timeout.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case '?':
+    default:
+      usage(argv);
+      return c == '?' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv);
+    return EXIT_FAILURE;
+  }
+  const char *name = argv[optind];
+
+  struct lys_shm_reader reader;
+  if (lys_shm_reader_open(&reader, name) != 0) {
+    fprintf(stderr, "Cannot open shared memory /%s.\n", name);
+    return EXIT_FAILURE;
+  }
+
+  uint32_t *frame = NULL;
+  size_t frame_capacity = 0;
+  int width = 0, height = 0;
+  int intact = 0, torn = 0, resizes = 0;
+  uint64_t first_seq = 0, last_seq = 0;
+  uint32_t generation = 0;
+
+  struct lys_shm_frame f;
+  while (intact + torn < num_frames && lys_shm_reader_next(&reader, timeout_ms, &f)) {
+    size_t n = (size_t)f.width * f.height;
+    if (n > frame_capacity) {
+      frame_capacity = n;
+      frame = realloc(frame, n * sizeof(uint32_t));
+    }
+    memcpy(frame, f.pixels, n * sizeof(uint32_t));
+    // The writer may have reused the slot while we were copying.
+    if (!lys_shm_reader_valid(&reader, &f)) {
+      torn++;
+      // Nor does the buffer hold the last intact frame any more.
+      width = height = 0;
+      continue;
+    }
+    if (intact > 0 && f.generation != generation) {
+      resizes++;
+    }
+    if (first_seq == 0) {
+      first_seq = f.seq;
+    }
+    last_seq = f.seq;
+    generation = f.generation;
+    width = f.width;
+    height = f.height;
+    intact++;
+  }
+
+  // Frames are numbered consecutively, so the ones in between that were
+  // not read intact were missed.
+  uint64_t published = intact > 0 ? last_seq - first_seq + 1 : 0;
+  printf("Read %d intact and %d torn frames, last %dx%d, with %d size changes.\n",
+         intact, torn, width, height, resizes);
+  printf("Missed %llu of the %llu frames published meanwhile.\n",
+         (unsigned long long)(published - intact), (unsigned long long)published);
+
+  if (output != NULL && width > 0) {
+    write_ppm(output, frame, width, height);
+  }
+
+  lys_shm_reader_close(&reader);
+  free(frame);
+  return intact > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}